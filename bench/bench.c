@@ -0,0 +1,196 @@
+/*
+ * Helper for bench.sh, so the numbers don't depend on what the system's
+ * tools can do or how fast they are:
+ *
+ *   bench tree dir count         creates dir/0 ... dir/<count-1>
+ *   bench flood bytes length     writes bytes of lines of length bytes
+ *   bench stamp                  writes the time, in seconds
+ *   bench run command ...        runs the command with its output going
+ *                                to /dev/null, then writes its wall clock
+ *                                time and peak RSS in KiB
+ *   bench gaps                   reads times, writes the 50th and 99th
+ *                                percentile of the gaps between them in ms
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <err.h>
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (double)ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long
+number(const char *s)
+{
+	char *end;
+	long n;
+
+	errno = 0;
+	n = strtol(s, &end, 10);
+	if (errno || *end || end == s || n < 0)
+		errx(1, "invalid number: %s", s);
+
+	return n;
+}
+
+static void
+tree(const char *dir, long count)
+{
+	char path[4096];
+	long i;
+
+	if (mkdir(dir, 0755) == -1 && errno != EEXIST)
+		err(1, "%s", dir);
+
+	for (i = 0; i < count; i++) {
+		snprintf(path, sizeof(path), "%s/%ld", dir, i);
+		if (mkdir(path, 0755) == -1 && errno != EEXIST)
+			err(1, "%s", path);
+	}
+}
+
+static void
+flood(long bytes, long length)
+{
+	static char buf[1 << 16];
+	size_t len, off, n;
+	ssize_t nw;
+	long i;
+
+	if (length < 1)
+		errx(1, "invalid line length");
+
+	for (i = 0; i < (long)sizeof(buf); i++)
+		buf[i] = (i+1) % length ? 'a' + i % 26 : '\n';
+
+	/* whole lines where the buffer allows, so they don't wrap oddly */
+	len = length < (long)sizeof(buf) ?
+	    sizeof(buf) / length * length : sizeof(buf);
+
+	while (bytes > 0) {
+		n = (size_t)bytes < len ? (size_t)bytes : len;
+		for (off = 0; off < n; off += nw)
+			if ((nw = write(STDOUT_FILENO, buf+off, n-off)) == -1)
+				err(1, "write");
+		bytes -= n;
+	}
+}
+
+static void
+run(char **argv)
+{
+	struct rusage usage;
+	double start;
+	pid_t pid;
+	int fd, status;
+
+	start = now();
+
+	if ((pid = fork()) == -1)
+		err(1, "fork");
+	if (!pid) {
+		if ((fd = open("/dev/null", O_WRONLY)) == -1)
+			err(127, "/dev/null");
+		dup2(fd, STDOUT_FILENO);
+		dup2(fd, STDERR_FILENO);
+		execvp(argv[0], argv);
+		err(127, "%s", argv[0]);
+	}
+
+	if (wait4(pid, &status, 0, &usage) == -1)
+		err(1, "wait4");
+
+	if (WIFSIGNALED(status))
+		errx(1, "%s: signal %d", argv[0], WTERMSIG(status));
+	if (WEXITSTATUS(status))
+		errx(1, "%s: exit status %d", argv[0], WEXITSTATUS(status));
+
+	/* ru_maxrss is in bytes on macOS, KiB elsewhere */
+#if defined(__APPLE__)
+	usage.ru_maxrss /= 1024;
+#endif
+	printf("%.3f %ld\n", now() - start, (long)usage.ru_maxrss);
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void
+gaps(void)
+{
+	double *times = NULL, t;
+	size_t num = 0, cap = 0, i;
+
+	while (scanf("%lf", &t) == 1) {
+		if (num == cap) {
+			cap = cap ? cap*2 : 1024;
+			if (!(times = realloc(times, cap * sizeof(*times))))
+				err(1, "realloc");
+		}
+		times[num++] = t;
+	}
+
+	if (num < 2)
+		errx(1, "need at least two times");
+
+	/* stamps from -j1 jobs, but sorted in case they're not */
+	qsort(times, num, sizeof(*times), cmp_double);
+	for (i = 0; i < num-1; i++)
+		times[i] = times[i+1] - times[i];
+	qsort(times, --num, sizeof(*times), cmp_double);
+
+	printf("%.3f %.3f\n", times[num/2] * 1000,
+	    times[num*99/100] * 1000);
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc < 2)
+		goto usage;
+
+	if (!strcmp(argv[1], "tree") && argc == 4)
+		tree(argv[2], number(argv[3]));
+	else if (!strcmp(argv[1], "flood") && argc == 4)
+		flood(number(argv[2]), number(argv[3]));
+	else if (!strcmp(argv[1], "stamp") && argc == 2)
+		printf("%.6f\n", now());
+	else if (!strcmp(argv[1], "run") && argc > 2)
+		run(argv+2);
+	else if (!strcmp(argv[1], "gaps") && argc == 2)
+		gaps();
+	else
+		goto usage;
+
+	return 0;
+
+usage:
+	fprintf(stderr,
+	    "usage: bench tree dir count\n"
+	    "       bench flood bytes length\n"
+	    "       bench stamp\n"
+	    "       bench run command ...\n"
+	    "       bench gaps\n");
+	return 1;
+}
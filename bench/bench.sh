@@ -0,0 +1,86 @@
+#!/bin/sh
+#
+# Runs within over generated directory trees and reports:
+#
+#  - jobs/s with commands that exit right away, for the spawn path
+#  - MB/s of output with commands that flood it in lines of various
+#    lengths, for the pipers and sinks
+#  - peak RSS of within (and, where the system counts those in, its jobs)
+#  - the 50th and 99th percentile time from one job exiting to the next
+#    starting, with -j1
+#
+# Usage: sh bench/bench.sh, or make bench. Settings come from the
+# environment:
+#
+#  WITHIN       binary to test (./within)
+#  FLAGS        extra options for within, e.g. --no-prefix
+#  JOBS         -j for the throughput tests (number of CPUs)
+#  DIRS         tree sizes for the spawn test ("10 1000 100000")
+#  FLOOD_DIRS   jobs for the output test (64)
+#  FLOOD_MB     output for every line length, in MB (256)
+#  LENGTHS      line lengths for the output test ("16 80 1024")
+#  STARTS       jobs for the latency test (2000)
+
+set -e
+
+BENCH=${BENCH:-bench/bench}
+WITHIN=${WITHIN:-./within}
+FLAGS=${FLAGS:-}
+JOBS=${JOBS:-$(getconf _NPROCESSORS_ONLN 2>/dev/null || echo 4)}
+DIRS=${DIRS:-10 1000 100000}
+FLOOD_DIRS=${FLOOD_DIRS:-64}
+FLOOD_MB=${FLOOD_MB:-256}
+LENGTHS=${LENGTHS:-16 80 1024}
+STARTS=${STARTS:-2000}
+
+case $BENCH in /*) ;; *) BENCH=$PWD/$BENCH ;; esac
+
+tmp=$(mktemp -d "${TMPDIR:-/tmp}/within-bench.XXXXXX")
+trap 'rm -rf "$tmp"' EXIT
+trap 'exit 1' HUP INT TERM
+
+# within runs the trees' directories from a list, as there may be too many
+# for the command line
+tree() {
+	if [ ! -d "$tmp/$1" ]; then
+		"$BENCH" tree "$tmp/$1" "$1"
+		ls "$tmp/$1" | sed "s|^|$tmp/$1/|" > "$tmp/$1.list"
+	fi
+}
+
+printf '%-24s %8s %6s %9s %10s %10s\n' \
+    test dirs jobs wall jobs/s rss_kb
+
+for n in $DIRS; do
+	tree "$n"
+	set -- $("$BENCH" run "$WITHIN" -j "$JOBS" $FLAGS -f "$tmp/$n.list" \
+	    - true)
+	awk -v n="$n" -v j="$JOBS" -v wall="$1" -v rss="$2" 'BEGIN {
+		printf "%-24s %8d %6d %8.3fs %10.0f %10d\n",
+		    "spawn true", n, j, wall, n / wall, rss }'
+done
+
+echo
+
+printf '%-24s %8s %6s %9s %10s %10s\n' \
+    test dirs jobs wall MB/s rss_kb
+
+tree "$FLOOD_DIRS"
+bytes=$((FLOOD_MB * 1024 * 1024 / FLOOD_DIRS))
+
+for len in $LENGTHS; do
+	set -- $("$BENCH" run "$WITHIN" -j "$JOBS" $FLAGS \
+	    -f "$tmp/$FLOOD_DIRS.list" - "$BENCH" flood "$bytes" "$len")
+	awk -v n="$FLOOD_DIRS" -v j="$JOBS" -v len="$len" -v wall="$1" \
+	    -v rss="$2" -v mb="$FLOOD_MB" 'BEGIN {
+		printf "%-24s %8d %6d %8.3fs %10.1f %10d\n",
+		    "flood " len "-byte lines", n, j, wall, mb / wall, rss }'
+done
+
+echo
+
+tree "$STARTS"
+set -- $("$WITHIN" -j 1 --no-prefix $FLAGS -f "$tmp/$STARTS.list" \
+    - "$BENCH" stamp | "$BENCH" gaps)
+printf 'start latency, -j1, %d jobs: p50 %sms, p99 %sms\n' \
+    "$STARTS" "$1" "$2"
@@ -1,69 +1,877 @@
 /*
  * Implementation notes
  *
- * Based around a select() event loop. As many jobs are started as -j allows
- * (1 by default), forking, descending into the given directory and executing
- * the command. For each job, both standard output and standard error are
- * redirected to a pipe that's read by a 'piper' which adds the 'directory:'
- * prefixes to the output. These pipers are effectively coroutines.
+ * Based around an event loop. As many jobs are started as -j allows (1 by
+ * default), spawning the command in the given directory with posix_spawn()
+ * or, where that can't change directories, fork() and execvp(). For each
+ * job, both standard output and standard error are redirected to a pipe
+ * that's read by a 'piper' which adds the 'directory:' prefixes to the
+ * output. These pipers are effectively coroutines.
  *
  * The event loop waits for finished jobs, starting new ones if there are
- * directories left, and for data on the pipes.
+ * directories left, for data on the pipes, and for room on the output.
  *
- * The select() specific code should be fairly easy to swap out. Point in
- * case, originally kqueue was used.
+ * Our own output is non-blocking where possible (see init_sinks()). What
+ * can't be written right away is queued on a 'sink' in order, and a piper
+ * with too much queued stops reading until it drains, so a slow reader
+ * holds up only the jobs producing the output, not the loop.
+ *
+ * The ev_*() functions wrap the platform's event mechanism: epoll on Linux,
+ * kqueue on the BSDs and macOS, and poll() elsewhere. Define USE_EPOLL,
+ * USE_KQUEUE or USE_POLL to override the choice. Pipers are registered once
+ * when started and unregistered when they hit EOF, so there's no per-wakeup
+ * rebuilding of descriptor sets and no FD_SETSIZE limit on -j. Child exits
+ * are events too: EVFILT_PROC with kqueue, a SIGCHLD self-pipe otherwise.
+ * Define USE_URING for an io_uring backend on Linux. There the pipers
+ * don't wait for readability but keep a read posted, into a ring of buffers
+ * shared by all, and sinks write their queue as a chain of linked writes,
+ * so all of a wakeup's reads and writes go with the wait in one system
+ * call. From Linux 6.7 it also waits for children with IORING_OP_WAITID.
  */
 
+#if defined(__linux__)
+# define _GNU_SOURCE	/* addfchdir_np() and friends */
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdarg.h>
 #include <errno.h>
 #include <string.h>
+#include <limits.h>
+
+#if !defined(USE_EPOLL) && !defined(USE_KQUEUE) && !defined(USE_POLL) && \
+    !defined(USE_URING)
+# if defined(__linux__)
+#  define USE_EPOLL
+# elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || \
+    defined(__NetBSD__) || defined(__DragonFly__)
+#  define USE_KQUEUE
+# else
+#  define USE_POLL
+# endif
+#endif
 
 #include <unistd.h>
-#include <sys/select.h>
+#include <sys/types.h>
 #include <sys/time.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
 #include <sys/wait.h>
 #include <err.h>
 #include <getopt.h>
 #include <signal.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <pthread.h>
+
+#include <poll.h>
+
+/*
+ * posix_spawn() is used to start jobs where posix_spawn_file_actions_
+ * addfchdir_np() is known to exist, fork() elsewhere. Define USE_SPAWN or
+ * USE_FORK to override.
+ */
+#if !defined(USE_SPAWN) && !defined(USE_FORK)
+# if defined(__APPLE__)
+#  include <AvailabilityMacros.h>
+# endif
+# if (defined(__GLIBC__) && \
+      (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 29))) || \
+     (defined(MAC_OS_X_VERSION_MIN_REQUIRED) && \
+      MAC_OS_X_VERSION_MIN_REQUIRED >= 101500)
+#  define USE_SPAWN
+# endif
+#endif
+
+#if defined(USE_SPAWN)
+# include <spawn.h>
+#endif
+
+/* enough to fchdir() to, where there's something less than O_RDONLY */
+#if defined(O_PATH)
+# define DIR_FLAGS	(O_PATH | O_DIRECTORY | O_CLOEXEC)
+#elif defined(O_SEARCH)
+# define DIR_FLAGS	(O_SEARCH | O_DIRECTORY | O_CLOEXEC)
+#else
+# define DIR_FLAGS	(O_RDONLY | O_DIRECTORY | O_CLOEXEC)
+#endif
+
+extern char **environ;
+
+/* --pin, with sched_setaffinity() and set_mempolicy() */
+#if defined(__linux__)
+# define USE_PIN
+# include <sched.h>
+# include <sys/syscall.h>
+# include <linux/mempolicy.h>
+#endif
+
+/* --io-class with ioprio_set(), --cgroup with cgroup v2 */
+#if defined(__linux__)
+# define USE_IOPRIO
+# define USE_CGROUP
+# include <sys/vfs.h>
+# define CGROUP2_MAGIC		0x63677270
+# define IOPRIO_CLASS_SHIFT	13
+# define IOPRIO_CLASS_BE	2
+# define IOPRIO_CLASS_IDLE	3
+# define IOPRIO_WHO_PROCESS	1
+#endif
+
+#if defined(USE_EPOLL)
+# include <sys/epoll.h>
+#elif defined(USE_KQUEUE)
+# include <sys/event.h>
+#elif defined(USE_URING)
+# if !defined(__linux__)
+#  error "USE_URING is only for Linux"
+# endif
+# include <sys/mman.h>
+# include <sys/syscall.h>
+# include <linux/io_uring.h>
+# define EV_ENTRIES	1024		/* submission queue size */
+# define EV_OP_WAITID	50		/* IORING_OP_WAITID, if headers lag */
+# define EV_BUF_SIZE	16384		/* of a read, see ev_read() */
+# define EV_KIND_POLL	0		/* low bits of user_data */
+# define EV_KIND_READ	1		/* with a piper */
+# define EV_KIND_WRITE	2		/* with an obuf */
+# define EV_TAG_CHILD	UINT64_MAX	/* kind 3, the others */
+# define EV_TAG_REMOVE	(UINT64_MAX-4)
+#endif
 
+#define MIN(a,b) ((a)<(b)?(a):(b))
 #define MAX(a,b) ((a)>(b)?(a):(b))
+#define LEN(a) (sizeof(a)/sizeof(*(a)))
+
+#define FNV_INIT 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+#ifndef NAME_MAX
+# define NAME_MAX 255
+#endif
+
+#define WALK_THREADS 8	/* for --find-marker, mostly waiting on I/O */
+
+#define CACHE_THREADS 8	/* for --cache fingerprints, likewise */
+#define CACHE_MAGIC "within-cache 1\n"
+
+#define TOKEN_NONE -1	/* job holds no jobserver token */
+#define TOKEN_FREE -2	/* job holds the one we get without asking */
+
+#define ADMIT_INTERVAL 1.0	/* seconds between -l/--mem-free samples */
+#define PROGRESS_INTERVAL 0.1	/* seconds between --progress redraws */
+
+/* a piper stops reading when it has this much output pending */
+#define PIPER_PENDING_MAX (64*1024)
+
+/* upper bound on iovecs per writev() in run_piper() */
+#if defined(IOV_MAX) && IOV_MAX < 128
+# define PIPER_IOVS IOV_MAX
+#else
+# define PIPER_IOVS 128
+#endif
+
+/*
+ * Output waiting to be written to a sink. Pipers have one for output that
+ * couldn't be written right away; groups have one per stream, spilling to
+ * a temporary file past --group-buffer.
+ */
+struct obuf {
+	char *data;
+	size_t off, len, cap;	/* unwritten data is [off, len) */
+	size_t ready;		/* for pipers, end of last full line */
+	int spill_fd;		/* -1 unless spilled, after data */
+	bool queued;		/* in a sink's queue */
+	bool rotated;		/* moved back to finish its line */
+	struct obuf *next;	/* in that queue */
+	struct piper *piper;	/* owner, or NULL if a group's */
+	struct group *group;
+#if defined(USE_URING)
+	struct sink *sink;	/* that queue's, for sink_wrote() */
+	bool writing;		/* in a chain of writes in flight */
+	bool whole;		/* which has all it had, up to wend */
+	size_t wend;
+	char *stale;		/* data as it was then, if it moved since */
+#endif
+};
+
+/*
+ * Standard output or error. Buffers are written out in the order they are
+ * queued, one at a time, so output from different jobs doesn't get mixed.
+ * Made non-blocking where possible, so a slow reader doesn't hold up the
+ * event loop; only jobs with full buffers wait.
+ */
+struct sink {
+	int fd;
+	int flags;		/* original, for restore_sinks(), or -1 */
+	bool nonblock;
+	bool watched;		/* registered with ev_add(), or writing */
+	bool tty;		/* --progress line has to be cleared first */
+	struct obuf *head, **tail;
+	struct obuf *midline;	/* wrote part of a line, has to finish it */
+#if defined(USE_URING)
+	int writes;		/* in flight, from the head on */
+	bool again;		/* one got EAGAIN, wait for room */
+#endif
+};
+
+/*
+ * A job's --group output. Flushed when complete, that is when the process
+ * has been reaped and both pipers are done.
+ */
+struct group {
+	struct obuf out[2];	/* stdout, stderr */
+	int refs;		/* job + open pipers + queued bufs */
+	size_t seq;		/* start order, for --keep-order */
+	bool discard;		/* of an attempt that'll be retried */
+	struct group *next;	/* --keep-order: waiting to be flushed */
+};
 
+/*
+ * Lives in its job's slot, and like it is reused. In use while the pipe is
+ * open or there's pending output, which can be after the job has exited.
+ */
 struct piper {
-	int in_fd;
-	FILE *out_file;
-	const char *prefix;	/* directory name */
+	int in_fd;		/* -1 after EOF */
+	int out_fd;
 	bool newline;		/* 1 if last character was a newline */
-	struct piper *next;	/* 't is but a linked list! */
+	bool reading;		/* in_fd registered with ev_add() */
+	bool splicing;		/* queued to splice() from in_fd */
+	struct sink *sink;
+	struct obuf pending;	/* what sink couldn't take yet */
+	struct group *group;	/* --group, or NULL */
+	struct obuf *hold;	/* in group, for this stream */
+	struct cache_entry *cache;	/* --cache, or NULL */
+	char *prefix;		/* the job's */
+	size_t prefix_len;
+	int stream;		/* 0 for stdout, 1 for stderr */
+	struct job *job;	/* NULL when replaying --cache */
+	char *part;		/* --format=jsonl: start of a line */
+	size_t part_len, part_cap;
+#if defined(USE_URING)
+	bool posted;		/* a read is, see piper_data() */
+#endif
+};
+
+/*
+ * --cache output of a running job, recorded to a temporary file that's
+ * moved into place if it succeeds. Referenced by the job and its pipers.
+ */
+struct cache_entry {
+	char *directory;
+	char *tmp;		/* temporary file */
+	int fd;			/* open on tmp */
+	int refs;
+	bool ok;		/* the job exited 0 */
+};
+
+/*
+ * Work for the --cache threads: checking if a directory's output is
+ * cached and still valid, or finishing a cache entry.
+ */
+struct cache_req {
+	char *directory;
+	struct cache_entry *entry;	/* to finish, or NULL to check */
+	int fd;			/* valid cached output, or -1 */
+	struct cache_req *next;
+};
+
+/* --hosts: a machine to run jobs on, over one ssh connection */
+struct host {
+	char *name;		/* for ssh, NULL for this machine */
+	char *control;		/* ssh ControlPath of the master */
+	int jobs;		/* job slots */
+	bool connected;		/* master running, see stop_hosts() */
+};
+
+/* calls fn(arg) at a point in time, see timer_set() */
+struct timer {
+	double when;		/* now() */
+	size_t pos;		/* in the heap plus 1, 0 if not set */
+	void (*fn)(void *);	/* may be NULL to just wake up */
+	void *arg;
+};
+
+/*
+ * A running job, in one of max_jobs slots. The slot is taken until the
+ * process has been reaped and its pipers are done.
+ */
+struct job {
+	pid_t pid;		/* 0 if reaped */
+	char *directory;
+	double start;		/* now() */
+	struct timer timer;	/* --timeout, then the kill */
+	bool timed_out;
+	bool stopping;		/* sent SIGTERM, see stop_job() */
+	struct group *group;	/* --group, or NULL */
+	struct cache_entry *cache;	/* --cache, or NULL */
+	struct host *host;	/* --hosts, or NULL */
+	int stdin_fd;		/* --stdin-broadcast pipe, or -1 */
+	size_t stdin_off;	/* how much of it has been fed */
+	bool stdin_watched;	/* stdin_fd registered with ev_add() */
+	int token;		/* jobserver byte, TOKEN_NONE or TOKEN_FREE */
+	double expected;	/* --progress: from history, or -1 */
+	char *prefix;		/* "[host:]directory: ", kept for reuse */
+	size_t prefix_cap;
+	char *exit_record;	/* --format=jsonl, until output is done */
+	size_t exit_len;
+	struct dep_node *node;	/* --deps, or NULL */
+	int attempt;		/* 1, or more with --retries */
+	bool retrying;		/* failed, will be run again */
+	int results_fd;		/* --results directory, or -1 */
+	char *results_name;	/* its name in there */
+	struct piper pipers[2];	/* stdout, stderr */
 };
 
+#if defined(USE_PIN)
+/* --pin: where a job slot's jobs run */
+struct pin {
+	cpu_set_t cpus;
+	unsigned long nodes;	/* NUMA node mask, for --pin=numa */
+	char **envp;		/* environ with WITHIN_CPUS */
+};
+#endif
+
+/* what --stats reports on per job */
+struct job_stats {
+	char *directory;
+	int status;		/* as from wait() */
+	bool timed_out;
+	double wall;		/* seconds */
+	double user, sys;	/* CPU seconds */
+	long maxrss;		/* KiB */
+};
+
+/* a directory waiting for --order=longest-first */
+struct pending {
+	char *directory;
+	double expected;	/* from history, or -1 */
+	size_t seq;		/* input order */
+};
+
+/* a failed directory waiting for its next --retries attempt */
+struct retry {
+	char *directory;
+	int attempt;		/* the next one, from 2 */
+	struct dep_node *node;	/* --deps, or NULL */
+	struct timer timer;
+	struct retry *next;	/* in retry_ready */
+};
+
+/* a directory in the --deps graph */
+struct dep_node {
+	char *directory;
+	struct dep_node **dependents;
+	size_t num_dependents, dependents_cap;
+	size_t waiting;		/* dependencies to run or running */
+	size_t left;		/* likewise, for the cycle check */
+	bool run;		/* in the input */
+	bool skipped;		/* as a dependency failed */
+	struct dep_node *next;	/* in the ready queue */
+};
+
+/* hash table entry of the history file */
+struct history {
+	char *directory;	/* absolute, NULL if empty */
+	double secs;
+};
+
+enum sched_order {
+	ORDER_INPUT,
+	ORDER_LONGEST_FIRST
+};
+
+enum out_format {
+	FORMAT_TEXT,
+	FORMAT_JSONL
+};
+
+enum stats_format {
+	STATS_NONE,
+	STATS_TABLE,
+	STATS_TSV
+};
+
+enum halt_when {
+	HALT_NEVER,
+	HALT_SOON,	/* start no more jobs */
+	HALT_NOW	/* and stop running ones */
+};
+
+enum pin_mode {
+	PIN_NONE,
+	PIN_CPU,	/* --pin */
+	PIN_NUMA	/* --pin=numa, memory too */
+};
+
+enum ev_type {
+	EV_READ,	/* udata's descriptor is readable */
+	EV_WRITE,	/* udata's descriptor is writable */
+	EV_CHILD,	/* one or more children may have exited */
+#if defined(USE_URING)
+	EV_DATA,	/* ev_read() for udata is done, with res bytes */
+	EV_WROTE	/* ev_write() for udata is, likewise */
+#endif
+};
+
+struct event {
+	enum ev_type type;
+	void *udata;
+#if defined(USE_URING)
+	char *data;	/* what EV_DATA read, in ring buffer bid */
+	int res;	/* bytes, or -errno */
+	int bid;
+#endif
+};
+
+#if defined(USE_URING)
+/* a descriptor's registration, by fd, see ev_add() */
+struct ev_reg {
+	struct event ev;
+	uint32_t gen;		/* in user_data, to tell old polls apart */
+	bool added;		/* by ev_add(), not since ev_del()'d */
+	bool armed;		/* with a poll submitted */
+};
+#endif
+
 static void parse_options(int, char **);
 static void usage(void);
-static void start_job(const char *);
-static void start_piper(int, FILE *, const char *);
+static void open_input(const char *);
+static void restore_input(void);
+static const char *read_directory(void);
+static bool more_input(void);
+static const char *next_directory(void);
+static bool more_directories(void);
+static void push_pending(const char *);
+static char *pop_pending(void);
+static int pending_cmp(const struct pending *, const struct pending *);
+static void load_history(void);
+static void save_history(void);
+static double lookup_history(const char *);
+static void set_history(const char *, double);
+static struct history *find_history(const char *);
+static struct history *find_history_abs(const char *);
+static char *absolute_path(const char *);
+static const char *default_history_path(void);
+static unsigned long long hash_string(const char *, unsigned long long);
+static unsigned long long hash_ull(unsigned long long, unsigned long long);
+static unsigned long long hash_command(void);
+static void start_cache(void);
+static void *cache_thread(void *);
+static void cache_submit(struct cache_req *);
+static void cache_fill(void);
+static const char *cache_next(void);
+static void cache_collect(void);
+static void cache_check(struct cache_req *);
+static void cache_store(struct cache_req *);
+static void cache_replay(struct cache_req *);
+static char *cache_path(const char *);
+static struct cache_entry *cache_start(const char *);
+static void cache_record(struct cache_entry *, int, const char *, size_t);
+static void cache_release(struct cache_entry *);
+static bool fingerprint(const char *, unsigned long long *);
+static unsigned long long fingerprint_dir(int, unsigned long long);
+static unsigned long long fingerprint_git(int, unsigned long long);
+static bool hash_file(int, const char *, unsigned long long *, char *,
+    size_t);
+static int cmp_name(const void *, const void *);
+static void start_walk(void);
+static void *walk_thread(void *);
+static void walk_dir(const char *);
+static void walk_push(char *);
+static void walk_emit(const char *);
+static void start_deps(void);
+static void load_deps(void);
+static void add_dep_input(const char *);
+static struct dep_node *find_dep(const char *);
+static struct dep_node **dep_slot(const char *, size_t);
+static void push_ready(struct dep_node *);
+static const char *deps_next(void);
+static void finish_dep(struct dep_node *, bool);
+static void skip_deps(struct dep_node *, const char *);
+static const char *next_job(int);
+static char **job_argv(char **, size_t);
+static size_t replace_braces(char *, const char *, const char *);
+static size_t json_prefix(char **, size_t *, const char *,
+    const struct host *);
+static size_t json_plain(const char *, size_t);
+static size_t utf8_len(const unsigned char *, size_t);
+static size_t utf8_cut(const char *, size_t);
+static size_t json_escape(char *, const char *, size_t);
+static void json_feed(struct piper *, const char *, size_t);
+static size_t json_middle(char *, size_t, const struct piper *);
+static void json_line(struct piper *, const char *, size_t, const char *,
+    size_t);
+static void json_eof(struct piper *);
+static char *json_event(const char *, size_t, size_t *, const char *, ...);
+static void json_emit(struct group *, char *, size_t);
+static void json_exit(struct job *, int);
+static void json_exit_flush(struct job *);
+static bool start_job(struct job *, const char *);
+static struct job *find_job(pid_t);
+static void finish_job(struct job *, int, const struct rusage *);
+static void print_stats(void);
+static void format_status(char *, size_t, int, bool);
+static void start_results(void);
+static void start_cgroup(void);
+static void remove_cgroup(void);
+static bool open_results(struct job *, const char *, int *, int *);
+static void finish_results(struct job *, int, double);
+static void fail_results(const char *);
+static char *results_name(const char *);
+static void tsv_field(FILE *, const char *);
+static int cmp_wall(const void *, const void *);
+static int cmp_cpu(const void *, const void *);
+static double now(void);
+static void timer_set(struct timer *, double);
+static void timer_cancel(struct timer *);
+static void timer_swap(size_t, size_t);
+static void timer_up(size_t);
+static void timer_down(size_t);
+static int timer_timeout(void);
+static void run_timers(void);
+static void job_timeout(void *);
+static bool retry_job(struct job *);
+static void retry_due(void *);
+static void stop_job(struct job *);
+static void kill_job(void *);
+static void signal_job(struct job *, int);
+static void parse_halt(const char *);
+static void check_halt(void);
+static void init_forwarding(void);
+static void sig_forward(int);
+static void start_progress(void);
+static void draw_progress(void *);
+static void clear_progress(void);
+static size_t jobs_left(bool *);
+static void format_secs(char *, size_t, double);
+static void init_info(void);
+static void sig_info(int);
+static void print_running(void);
+static int cmp_start(const void *, const void *);
+static void parse_hosts(const char *);
+static void start_hosts(void);
+static void stop_hosts(void);
+static pid_t run_ssh(char **, bool);
+static char **host_argv(struct host *, const char *, char **);
+static char *sh_quote(const char *);
+static int auto_jobs(void);
+static double cgroup_cpu_quota(void);
+static double cgroup_walk(const char *, const char *, bool);
+static bool may_start(int);
+static size_t mem_available(void);
+#if defined(USE_SPAWN)
+static pid_t spawn_job(char **, int, int, int, int);
+#endif
+static bool can_nice(int);
+static void child_fail(const char *);
+static pid_t fork_job(char **, int, int, int, int, int);
+static void start_broadcast(void);
+static void restore_broadcast(void);
+static void read_broadcast(void);
+static void feed_job(struct job *);
+static void stop_feed(struct job *);
+static bool join_jobserver(void);
+static void start_jobserver(int);
+static void restore_jobserver(void);
+static bool take_token(struct job *);
+static void give_token(struct job *);
+#if defined(USE_PIN)
+static void init_pins(void);
+static bool parse_cpulist(const char *, cpu_set_t *);
+static void format_cpulist(const cpu_set_t *, char *, size_t);
+#endif
+static void make_pipe(int [2]);
+static struct job *free_slot(void);
+static void start_piper(struct job *, int, int);
 static void run_piper(struct piper *);
-static void remove_piper(struct piper *);
-static void sig_chld(int);
+static void piper_feed(struct piper *, char *, size_t);
+static void run_raw_piper(struct piper *);
+static int splice_piper(struct piper *);
+static void piper_write(struct piper *, struct iovec *, int);
+static void piper_eof(struct piper *);
+static void free_piper(struct piper *);
+static void pause_piper(struct piper *);
+static void resume_piper(struct piper *);
+#if defined(USE_URING)
+static void piper_data(struct piper *, const struct event *);
+#endif
+static struct group *new_group(void);
+static void release_group(struct group *);
+static void flush_group(struct group *);
+static void obuf_append(struct obuf *, const struct iovec *, int);
+static void init_sinks(void);
+static void restore_sinks(void);
+static void sink_queue(struct sink *, struct obuf *);
+static void sink_flush(struct sink *);
+static void sink_drained(struct obuf *);
+static void sink_mark(struct sink *, struct obuf *, char);
+#if defined(USE_URING)
+static void sink_submit(struct sink *);
+static void sink_wrote(struct obuf *, int);
+static void sink_written(struct sink *);
+#endif
+static size_t parse_size(const char *, const char *);
+static double parse_duration(const char *, const char *);
+static bool write_some(int, struct iovec **, int *, const char **);
+static void write_all(int, struct iovec *, int);
+static void raise_fd_limit(void);
+
+static void ev_init(void);
+static void ev_add(int, enum ev_type, void *);
+static void ev_del(int, enum ev_type);
+static void ev_add_child(pid_t);
+static int ev_wait(struct event *, int, int);
+#if defined(USE_URING)
+static void ev_read(int, void *);
+static void ev_write(int, const char *, size_t, void *, bool);
+static void ev_give(int);
+#endif
 
 /* command line options */
 static int max_jobs = 1;
 static int num_directories;
 static char **directories;
 static char **command;
+static char input_delim = '\n';	/* -0 makes it '\0' */
+static size_t batch_size = 1;		/* -n */
+static bool substituting;		/* {} in the command */
+static enum stats_format stats_format;
+static enum out_format out_format;	/* --format */
+static enum sched_order sched_order;
+static bool no_prefix;
+static bool group_output;		/* --group */
+static bool keep_order;			/* --keep-order */
+static size_t group_limit = 1 << 20;	/* in memory per stream */
+static double max_load;			/* -l, 0 if not used */
+static size_t min_mem_free;		/* --mem-free, 0 if not used */
+static enum pin_mode pin_mode;
+static int job_nice;			/* --nice, added to ours */
+static int io_prio;			/* --io-class, 0 to inherit ours */
+static const char *cgroup_path;		/* --cgroup */
+static int cgroup_weight;		/* --cgroup-weight, 0 to leave */
+static int cgroup_fd = -1;		/* its cgroup.procs */
+static bool cgroup_made;		/* by us, to remove when done */
+static bool fork_jobs;			/* for what only the child can set */
+
+static double job_timeout_secs;		/* --timeout, 0 if not used */
+static int max_retries;			/* --retries */
+static double retry_delay = 1;		/* --retry-delay, doubling */
+static size_t retries_waiting;		/* for their timers */
+static struct retry *retry_ready;	/* timer's gone off, in order */
+static struct retry **retry_ready_tail = &retry_ready;
+static struct retry *retry_taken;	/* by start_job() */
+static const char *job_held;		/* from next_job(), wants a token */
+static double kill_after = 10;		/* --kill-after */
+static enum halt_when halt_when;
+static size_t halt_fail = 1;		/* --halt fail=, jobs or percent */
+static bool halt_percent;
+static bool use_pgroups;		/* their own, for stopping jobs */
+
+static bool halting;			/* start no more jobs */
+static size_t num_started, num_failed;
+static volatile sig_atomic_t got_signal;	/* forwarded to jobs */
+static volatile sig_atomic_t got_info;	/* SIGUSR1 or SIGINFO */
+
+static bool progress;			/* --progress, if stderr is a tty */
+static bool progress_shown;		/* the line is on screen */
+static struct timer progress_timer;
+static double progress_start;		/* now() */
+static double history_mean = -1;	/* job time recorded, on average */
+static size_t num_done;			/* reaped, for --progress */
+static double done_wall;		/* their total wall clock time */
+
+static double admit_next;		/* when to sample again */
+static double admit_load;		/* as of the last sample */
+static bool admit_mem_ok;		/* likewise */
+static int admit_started;		/* jobs since the last sample */
+static struct timer admit_timer;	/* wakes us for the next sample */
+
+static struct timer **timers;		/* binary heap, soonest first */
+static size_t num_timers, timers_cap;
+
+static size_t group_seq;		/* next to start */
+static size_t group_flush_seq;		/* next to flush, --keep-order */
+static struct group *group_waiting;	/* sorted by seq */
+
+static struct sink sinks[2];		/* stdout, stderr */
+static const char *history_path;	/* --history, NULL if not used */
+
+static const char *results_path;	/* --results, NULL if not used */
+static int results_fd = -1;		/* open on it */
+static FILE *results_index;		/* index.tsv in it */
+
+static struct pending *pending;		/* binary heap */
+static size_t num_pending, pending_cap, pending_seq;
+
+static struct history *history;	/* open addressing, power of 2 */
+static size_t num_history, history_cap;
+static char **history_other;		/* lines for other commands */
+static size_t num_history_other, history_other_cap;
+static unsigned long long history_cmd;	/* hash_command() */
+static char *start_cwd;		/* for absolute_path() */
+
+static struct host *hosts;		/* --hosts, NULL if not used */
+static int num_hosts;
+static char *host_dir;			/* holds the ControlPaths */
+
+/*
+ * --stdin-broadcast: our standard input, kept in a file so that every job
+ * can be fed all of it from its own offset, even when it starts late. A
+ * regular file is used as-is.
+ */
+static bool stdin_broadcast;
+static int bcast_fd = -1;		/* the file */
+static off_t bcast_base;		/* where the input starts in it */
+static size_t bcast_len;		/* how much there is so far */
+static bool bcast_eof;			/* and that's all */
+static int bcast_flags = -1;		/* stdin's, for restore_broadcast() */
+static bool bcast_watched;		/* stdin registered with ev_add() */
+
+/*
+ * GNU make's jobserver, from MAKEFLAGS or our own with --jobserver: a pipe
+ * with a byte for every job that may run on top of the one each process
+ * gets for free. Nested makes and we share the same limit.
+ */
+static int js_read_fd = -1;		/* our own, non-blocking */
+static int js_write_fd = -1;
+static int js_flags = -1;		/* shared read end's, to restore */
+static bool js_free_taken;		/* TOKEN_FREE is in use */
+static bool js_watched;			/* js_read_fd registered */
+
+static const char *cache_dir;		/* --cache, NULL if not used */
+static unsigned long long cache_cmd;	/* hash_command() */
+static dev_t cache_dev;			/* of cache_dir, not fingerprinted */
+static ino_t cache_ino;
+static int cache_pipe[2];		/* written to when work is done */
+static struct cache_req *cache_todo;	/* for the threads, in order */
+static struct cache_req **cache_todo_tail = &cache_todo;
+static struct cache_req *cache_done;	/* by the threads, a stack */
+static struct cache_req *cache_ready;	/* checked, to run, in order */
+static struct cache_req **cache_ready_tail = &cache_ready;
+static size_t cache_checking;		/* submitted or ready to run */
+static size_t cache_waiting;		/* submitted, checks or stores */
+static size_t cache_storing;		/* entries being finished */
+static size_t num_cached;		/* replayed instead of run */
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_cond = PTHREAD_COND_INITIALIZER;
+
+static const char *deps_path;		/* --deps, NULL if not used */
+static struct dep_node **dep_table;	/* open addressing, power of 2 */
+static size_t dep_table_cap;
+static struct dep_node **dep_nodes;	/* all, in file order */
+static size_t num_dep_nodes, dep_nodes_cap;
+static struct dep_node **dep_runs;	/* to run, in input order */
+static size_t num_dep_runs, dep_runs_cap;
+static struct dep_node *dep_ready;	/* can start, in input order */
+static struct dep_node **dep_ready_tail = &dep_ready;
+static struct dep_node *dep_taken;	/* by start_job() */
+static size_t deps_left;		/* neither started nor skipped */
+
+/*
+ * With -n, the directories for the next job. They're copied since
+ * next_directory()'s are only valid until the next call.
+ */
+static char **batch;
+static size_t batch_len;
+static bool batch_taken;		/* by start_job(), free them */
+
+static char *arena;			/* argv built by job_argv() */
+static size_t arena_cap;
+
+static double json_epoch;		/* now() at startup, for "time" */
+static char *json_buf;			/* records built by json_feed() */
+static size_t json_len, json_cap;
+
+static struct job *jobs;		/* max_jobs slots */
+#if defined(USE_PIN)
+static struct pin *pins;		/* per slot, NULL without --pin */
+#endif
+static int num_pipers;			/* in use */
+static struct job_stats *stats;		/* finished jobs, for --stats */
+static size_t num_stats, stats_cap;
+
+/*
+ * Directories from -f are read lazily, as job slots free up, so the first
+ * jobs start right away and memory use stays bounded. Pipes and terminals
+ * are read non-blockingly through the event loop.
+ */
+static int next_arg;		/* index into directories */
+static int input_fd = -1;
+static int input_flags;		/* original, for restore_input() */
+static bool input_stdin;	/* -f -, children get /dev/null */
+static bool input_watched;	/* registered with ev_add() */
+static bool input_eof;
+static char *input_buf;
+static size_t input_off, input_len, input_cap;
+
+/*
+ * --find-marker walks the roots with a few threads sharing a stack of
+ * directories to scan. Matches are written to a pipe that's read like -f -0
+ * input, so jobs start while the walk is still going.
+ */
+static const char *walk_marker;
+static char **walk_stack;		/* directories to be scanned */
+static size_t walk_len, walk_cap;
+static int walk_busy;			/* threads scanning a directory */
+static int walk_fd = -1;		/* write end of the input pipe */
+static pthread_mutex_t walk_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t walk_out_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t walk_cond = PTHREAD_COND_INITIALIZER;
+
+#if defined(USE_EPOLL)
+static int ev_fd;
+static struct event *ev_regs;		/* by fd, as epoll only has one */
+static int ev_regs_cap;
+#elif defined(USE_KQUEUE)
+static int ev_fd;
+static bool ev_child_pending;		/* exited before EVFILT_PROC */
+#elif defined(USE_URING)
+static int ev_fd;
+static struct ev_reg *ev_regs;
+static int ev_regs_cap;
+static struct io_uring_sqe *ev_sqes;
+static struct io_uring_cqe *ev_cqes;
+static unsigned *ev_sq_head, *ev_sq_tail, *ev_sq_mask;
+static unsigned *ev_cq_head, *ev_cq_tail, *ev_cq_mask;
+static unsigned ev_sq_entries;
+static unsigned ev_sq_local;		/* our tail, given on io_uring_enter */
+static bool ev_waitid;			/* IORING_OP_WAITID, else SIGCHLD */
+static siginfo_t ev_siginfo;		/* for it to write, unused */
+static struct io_uring_buf_ring *ev_bufring;	/* for ev_read() */
+static char *ev_bufs;			/* what it points into */
+static unsigned ev_bufs_mask;		/* their number, less one */
+#else
+static struct pollfd *ev_pollfds;	/* registered descriptors */
+static struct event *ev_regs;		/* parallel to ev_pollfds */
+static int *ev_index;			/* fd -> index in ev_pollfds */
+static int ev_count, ev_cap, ev_index_cap;
+#endif
 
-struct piper *pipers;
+#if !defined(USE_KQUEUE)
+static int ev_sigpipe[2];		/* written to by sig_chld() */
+static void init_sigpipe(bool);
+static void sig_chld(int);
+static void drain_sigpipe(void);
+#endif
 
 int
 main(int argc, char **argv)
 {
-	int directory = 0;
+	const char *directory;
 	int num_jobs = 0;
-	fd_set piper_fds;
-	struct piper *piper;
-	struct piper *piper_next;
-	int nfds;
+	struct event evs[64];
+	struct rusage usage;
+	struct job *job;
+	int num_evs, i, j, k;
+	bool reap, retry;
 	int status = 0;
 	int child_status;
 	pid_t child_pid;
@@ -73,62 +881,206 @@ main(int argc, char **argv)
 #endif
 
 	parse_options(argc, argv);
+	raise_fd_limit();
+	ev_init();
+	/* before init_sinks(), the masters keep our stderr */
+	if (hosts)
+		start_hosts();	/* may lower max_jobs */
+	init_sinks();
 
-	signal(SIGCHLD, sig_chld);
+	if (!(jobs = calloc((size_t)max_jobs, sizeof(*jobs))))
+		err(1, "calloc");
+	for (i = 0; i < max_jobs; i++) {
+		jobs[i].pipers[0].in_fd = -1;
+		jobs[i].pipers[1].in_fd = -1;
+		jobs[i].stdin_fd = -1;
+		jobs[i].token = TOKEN_NONE;
+		jobs[i].results_fd = -1;
+	}
+	/* slots by host, all taking from the same queue of directories */
+	for (i = 0, j = 0; i < num_hosts; i++)
+		for (k = 0; k < hosts[i].jobs; k++)
+			jobs[j++].host = hosts[i].name ? &hosts[i] : NULL;
+#if defined(USE_PIN)
+	if (pin_mode != PIN_NONE)
+		init_pins();
+#endif
+	if (cgroup_path)
+		start_cgroup();
+	fork_jobs = pin_mode != PIN_NONE || job_nice || io_prio ||
+	    cgroup_path;
 
-	while (num_jobs || pipers || directory < num_directories) {
-		/* start new jobs */
+	if (use_pgroups)
+		init_forwarding();
+	init_info();
+	if (progress)
+		start_progress();
+	if (cache_dir)
+		start_cache();
+	if (results_path)
+		start_results();
+	if (deps_path)
+		start_deps();
+	if (stdin_broadcast)
+		start_broadcast();
 
-		while (num_jobs < max_jobs && directory < num_directories) {
-			start_job(directories[directory]);
-			num_jobs++;
-			directory++;
-		}
+	while (num_jobs || num_pipers ||
+	    (!halting && (more_directories() || cache_checking ||
+	    retries_waiting || retry_ready || job_held)) ||
+	    cache_storing || sinks[0].head || sinks[1].head) {
+		if (got_signal)
+			halting = true;
+
+		/* start new jobs, with --cache once checked */
 
-		/* wait for data or SIGCHLD interrupt */
+		if (cache_dir)
+			cache_fill();
 
-		FD_ZERO(&piper_fds);
-		nfds = 0;
-		for (piper = pipers; piper; piper = piper->next) {
-			FD_SET(piper->in_fd, &piper_fds);
-			nfds = MAX(nfds, piper->in_fd+1);
+		/*
+		 * A token only once there's something to start, so waking
+		 * up to nothing doesn't cost a read and write on make's pipe.
+		 */
+		while (!halting && num_jobs < max_jobs && (job = free_slot()) &&
+		    may_start(num_jobs)) {
+			if (!job_held && !(job_held = next_job(num_jobs)))
+				break;
+			if (!take_token(job))
+				break;
+			directory = job_held;
+			job_held = NULL;
+			num_started++;
+			if (start_job(job, directory)) {
+				num_jobs++;
+				admit_started++;
+			} else {
+				give_token(job);
+				if (results_path)
+					fail_results(directory);
+				if (job->node) {
+					finish_dep(job->node, false);
+					job->node = NULL;
+				}
+				status = 1;
+				num_failed++;
+				check_halt();
+			}
+			if (retry_taken) {
+				free(retry_taken->directory);
+				free(retry_taken);
+				retry_taken = NULL;
+			}
 		}
 
-		if (select(nfds, &piper_fds, NULL, NULL, NULL) != -1) {
-			for (piper = pipers; piper; piper = piper_next) {
-				/* dereference now, prevent use after free */
-				piper_next = piper->next;
+		if (!num_jobs && !num_pipers && !input_watched &&
+		    !cache_waiting && !retries_waiting &&
+		    !sinks[0].watched && !sinks[1].watched)
+			continue;
+
+		/* wait for data, child exits or timers */
 
-				if (FD_ISSET(piper->in_fd, &piper_fds))
-					run_piper(piper);
-			}
-		} else if (errno == EBADF) {
-			/* broken pipe, process exited before select() */\
-			for (piper = pipers; piper; piper = piper_next) {
-				/* dereference now, prevent use after free */
-				piper_next = piper->next;
-
-				if (fcntl(piper->in_fd, F_GETFL) == -1) {
-					if (errno != EBADF)
-						err(1, "fcntl");
-					remove_piper(piper);
+		num_evs = ev_wait(evs, (int)LEN(evs), timer_timeout());
+		reap = false;
+
+		for (i = 0; i < num_evs; i++) {
+			switch (evs[i].type) {
+			case EV_READ:
+				if (evs[i].udata == cache_pipe)
+					cache_collect();
+				else if (evs[i].udata == &bcast_fd)
+					read_broadcast();
+				else if (evs[i].udata == &js_read_fd) {
+					/* there's a token, take_token() */
+					ev_del(js_read_fd, EV_READ);
+					js_watched = false;
+				}
+				else if (evs[i].udata != &input_fd)
+					run_piper(evs[i].udata);
+				else {
+					/* next_directory() will read */
+					ev_del(input_fd, EV_READ);
+					input_watched = false;
 				}
+				break;
+			case EV_WRITE:
+				if (evs[i].udata == &sinks[0] ||
+				    evs[i].udata == &sinks[1])
+					sink_flush(evs[i].udata);
+				else
+					feed_job(evs[i].udata);
+				break;
+			case EV_CHILD:
+				reap = true;
+				break;
+#if defined(USE_URING)
+			case EV_DATA:
+				piper_data(evs[i].udata, &evs[i]);
+				break;
+			case EV_WROTE:
+				sink_wrote(evs[i].udata, evs[i].res);
+				break;
+#endif
 			}
-		} else if (errno != EINTR)
-			err(1, "select");
+		}
+
+		/* like --progress, not between output and its line's end */
+		if (got_info && !sinks[1].head && !sinks[1].midline) {
+			got_info = 0;
+			print_running();
+		}
 
 		/* collect child exits */
 
-		while (num_jobs) {
-			child_pid = waitpid(-1, &child_status, WNOHANG);
+		while (reap && num_jobs) {
+			child_pid = wait4(-1, &child_status, WNOHANG, &usage);
 			if (child_pid == -1)
-				err(1, "waitpid");
+				err(1, "wait4");
 			if (child_pid == 0)
 				break;
-			num_jobs--;
-			if (child_status)
+			if (!(job = find_job(child_pid)))
+				continue;
+			/* only the last attempt counts */
+			retry = (child_status || job->timed_out) &&
+			    retry_job(job);
+			if (retry)
+				;
+			else if (job->timed_out)
+				status = 124;	/* like timeout(1) */
+			else if (child_status && !status)
 				status = 1; /* safer than child_status */
+			finish_job(job, child_status, &usage);
+			num_jobs--;
+			if (child_status && !retry) {
+				num_failed++;
+				check_halt();
+			}
 		}
+
+		run_timers();
+	}
+
+	/* halted with retries to go, their last attempts failed */
+	if (retries_waiting || retry_ready)
+		status = status ? status : 1;
+
+	if (progress_shown)
+		clear_progress();
+
+	/* stdio doesn't cope with EAGAIN */
+	restore_sinks();
+
+	if (results_index && fclose(results_index) == EOF)
+		warn("%s/index.tsv", results_path);
+	if (stats_format != STATS_NONE)
+		print_stats();
+	if (history_path)
+		save_history();
+	if (hosts)
+		stop_hosts();
+
+	/* die like the jobs did */
+	if (got_signal) {
+		signal(got_signal, SIG_DFL);
+		raise(got_signal);
 	}
 
 	return status;
@@ -137,15 +1089,212 @@ main(int argc, char **argv)
 static void
 parse_options(int argc, char **argv)
 {
-	int c, i;
+	static const struct option long_opts[] = {
+		{ "find-marker", required_argument, NULL, 'M' },
+		{ "no-prefix", no_argument, NULL, 'P' },
+		{ "group", no_argument, NULL, 'G' },
+		{ "keep-order", no_argument, NULL, 'K' },
+		{ "group-buffer", required_argument, NULL, 'B' },
+		{ "stats", optional_argument, NULL, 'S' },
+		{ "history", required_argument, NULL, 'H' },
+		{ "order", required_argument, NULL, 'O' },
+		{ "mem-free", required_argument, NULL, 'F' },
+		{ "pin", optional_argument, NULL, 'C' },
+		{ "timeout", required_argument, NULL, 'T' },
+		{ "kill-after", required_argument, NULL, 'k' },
+		{ "halt", required_argument, NULL, 'z' },
+		{ "cache", required_argument, NULL, 'c' },
+		{ "hosts", required_argument, NULL, 'h' },
+		{ "batch", required_argument, NULL, 'n' },
+		{ "stdin-broadcast", no_argument, NULL, 'I' },
+		{ "jobserver", required_argument, NULL, 'J' },
+		{ "progress", no_argument, NULL, 'p' },
+		{ "format", required_argument, NULL, 'o' },
+		{ "results", required_argument, NULL, 'R' },
+		{ "deps", required_argument, NULL, 'D' },
+		{ "retries", required_argument, NULL, 'r' },
+		{ "retry-delay", required_argument, NULL, 'd' },
+		{ "nice", required_argument, NULL, 'N' },
+		{ "io-class", required_argument, NULL, 'i' },
+		{ "cgroup", required_argument, NULL, 'g' },
+		{ "cgroup-weight", required_argument, NULL, 'w' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	const char *input_path = NULL;
+	const char *hosts_arg = NULL;
+	bool no_dirs_ok, jobs_set = false;
+	char *end;
+	int c, i, js_tokens = 0;
 
-	while ((c = getopt(argc, argv, "j:")) != -1) {
+	/* '+' stops GNU getopt from taking the command's options */
+	while ((c = getopt_long(argc, argv, "+0f:j:l:n:", long_opts,
+	    NULL)) != -1) {
 		switch (c) {
+		case '0':
+			input_delim = '\0';
+			break;
+		case 'f':
+			input_path = optarg;
+			break;
 		case 'j':
+			jobs_set = true;
+			if (!strcmp(optarg, "auto")) {
+				max_jobs = auto_jobs();
+				break;
+			}
 			max_jobs = (int)strtol(optarg, NULL, 10);
 			if (max_jobs < 1)
 				errx(1, "invalid -j: %s", optarg);
 			break;
+		case 'n':
+			batch_size = (size_t)strtol(optarg, &end, 10);
+			if (*end || end == optarg || (long)batch_size < 1)
+				errx(1, "invalid -n: %s", optarg);
+			break;
+		case 'l':
+			max_load = strtod(optarg, &end);
+			if (*end || end == optarg || max_load <= 0)
+				errx(1, "invalid -l: %s", optarg);
+			break;
+		case 'F':
+#if !defined(__linux__) && !defined(_SC_AVPHYS_PAGES)
+			errx(1, "--mem-free is not supported on this system");
+#endif
+			min_mem_free = parse_size(optarg, "--mem-free");
+			break;
+		case 'T':
+			job_timeout_secs = parse_duration(optarg, "--timeout");
+			break;
+		case 'k':
+			kill_after = parse_duration(optarg, "--kill-after");
+			break;
+		case 'z':
+			parse_halt(optarg);
+			break;
+		case 'c':
+			cache_dir = optarg;
+			break;
+		case 'h':
+			hosts_arg = optarg;
+			break;
+		case 'I':
+			stdin_broadcast = true;
+			break;
+		case 'R':
+			results_path = optarg;
+			break;
+		case 'D':
+			deps_path = optarg;
+			break;
+		case 'r':
+			max_retries = (int)strtol(optarg, &end, 10);
+			if (*end || end == optarg || max_retries < 0)
+				errx(1, "invalid --retries: %s", optarg);
+			break;
+		case 'd':
+			retry_delay = parse_duration(optarg, "--retry-delay");
+			break;
+		case 'N':
+			job_nice = (int)strtol(optarg, &end, 10);
+			if (*end || end == optarg || job_nice < -40 ||
+			    job_nice > 40)
+				errx(1, "invalid --nice: %s", optarg);
+			/* or every job would fail in the child */
+			if (job_nice < 0 && !can_nice(job_nice))
+				err(1, "--nice %d", job_nice);
+			break;
+		case 'i':
+#if !defined(USE_IOPRIO)
+			errx(1, "--io-class is not supported on this system");
+#else
+			/* best-effort at its lowest level, below the default */
+			if (!strcmp(optarg, "idle"))
+				io_prio = IOPRIO_CLASS_IDLE <<
+				    IOPRIO_CLASS_SHIFT;
+			else if (!strcmp(optarg, "best-effort"))
+				io_prio = IOPRIO_CLASS_BE <<
+				    IOPRIO_CLASS_SHIFT | 7;
+			else
+				errx(1, "invalid --io-class: %s", optarg);
+			break;
+#endif
+		case 'g':
+#if !defined(USE_CGROUP)
+			errx(1, "--cgroup is not supported on this system");
+#endif
+			cgroup_path = optarg;
+			break;
+		case 'w':
+			cgroup_weight = (int)strtol(optarg, &end, 10);
+			if (*end || end == optarg || cgroup_weight < 1 ||
+			    cgroup_weight > 10000)
+				errx(1, "invalid --cgroup-weight: %s", optarg);
+			break;
+		case 'o':
+			if (!strcmp(optarg, "text"))
+				out_format = FORMAT_TEXT;
+			else if (!strcmp(optarg, "jsonl"))
+				out_format = FORMAT_JSONL;
+			else
+				errx(1, "invalid --format: %s", optarg);
+			break;
+		case 'p':
+			/* not worth breaking a pipe's output for */
+			progress = isatty(STDERR_FILENO);
+			break;
+		case 'J':
+			js_tokens = (int)strtol(optarg, &end, 10);
+			if (*end || end == optarg || js_tokens < 1 ||
+			    js_tokens > PIPE_BUF)
+				errx(1, "invalid --jobserver: %s", optarg);
+			break;
+		case 'C':
+#if !defined(USE_PIN)
+			errx(1, "--pin is not supported on this system");
+#endif
+			if (!optarg || !strcmp(optarg, "cpu"))
+				pin_mode = PIN_CPU;
+			else if (!strcmp(optarg, "numa"))
+				pin_mode = PIN_NUMA;
+			else
+				errx(1, "invalid --pin: %s", optarg);
+			break;
+		case 'M':
+			walk_marker = optarg;
+			break;
+		case 'P':
+			no_prefix = true;
+			break;
+		case 'G':
+			group_output = true;
+			break;
+		case 'K':
+			group_output = true;
+			keep_order = true;
+			break;
+		case 'B':
+			group_limit = parse_size(optarg, "--group-buffer");
+			break;
+		case 'H':
+			history_path = optarg;
+			break;
+		case 'O':
+			if (!strcmp(optarg, "input"))
+				sched_order = ORDER_INPUT;
+			else if (!strcmp(optarg, "longest-first"))
+				sched_order = ORDER_LONGEST_FIRST;
+			else
+				errx(1, "invalid --order: %s", optarg);
+			break;
+		case 'S':
+			if (!optarg || !strcmp(optarg, "table"))
+				stats_format = STATS_TABLE;
+			else if (!strcmp(optarg, "tsv"))
+				stats_format = STATS_TSV;
+			else
+				errx(1, "invalid --stats: %s", optarg);
+			break;
 		default:
 			exit(1);
 		}
@@ -154,14 +1303,37 @@ parse_options(int argc, char **argv)
 	argc -= optind;
 	argv += optind;
 
-	if (argc < 2)
+	if (input_path && walk_marker)
+		errx(1, "-f and --find-marker are mutually exclusive");
+	if (no_prefix && out_format == FORMAT_JSONL)
+		errx(1, "--no-prefix can't be used with --format=jsonl");
+	/* there's no output passing through us to work with */
+	if (results_path && (group_output || cache_dir ||
+	    out_format == FORMAT_JSONL))
+		errx(1, "--results can't be used with --group, --keep-order, "
+		    "--cache or --format=jsonl");
+	if (cgroup_weight && !cgroup_path)
+		errx(1, "--cgroup-weight needs --cgroup");
+	json_epoch = now();
+	if (stdin_broadcast && input_path && !strcmp(input_path, "-"))
+		errx(1, "-f - can't be used with --stdin-broadcast");
+
+	/* nor with --deps, which then runs all of the file */
+	if (deps_path && (batch_size > 1 || cache_dir ||
+	    sched_order != ORDER_INPUT))
+		errx(1, "--deps can't be used with -n, --cache or --order");
+
+	/* with -f or --find-marker, there needn't be directories in argv */
+	no_dirs_ok = input_path || walk_marker || deps_path;
+
+	if (argc < (no_dirs_ok ? 1 : 2))
 		usage();
 
 	for (i = 0; i < argc; i++) {
 		/* directories separated from command with - or -- */
 		if (strcmp("-", argv[i]) && strcmp("--", argv[i]))
 			continue;
-		if (i < 1 || i+1 >= argc)
+		if ((i < 1 && !no_dirs_ok) || i+1 >= argc)
 			usage();
 		num_directories = i;
 		directories = argv;
@@ -169,130 +1341,6285 @@ parse_options(int argc, char **argv)
 		break;
 	}
 
-	if (i == argc) {
+	if (i == argc && no_dirs_ok) {
+		num_directories = 0;
+		command = argv;
+	} else if (i == argc) {
 		num_directories = 1;
 		directories = argv;
 		command = argv+1;
 	}
+
+	for (i = 0; command[i]; i++)
+		if (strstr(command[i], "{}"))
+			substituting = true;
+	if (batch_size > 1) {
+		if (cache_dir)
+			errx(1, "--cache can't be used with -n");
+		if (max_retries)
+			errx(1, "--retries can't be used with -n");
+		if (!(batch = calloc(batch_size, sizeof(*batch))))
+			err(1, "calloc");
+	}
+
+	/*
+	 * Before anything gets opened, make's descriptors are only checked
+	 * by number. Without -j, the jobserver is what limits us.
+	 */
+	if (js_tokens) {
+		start_jobserver(js_tokens);
+		if (!jobs_set)
+			max_jobs = js_tokens;
+	} else if (join_jobserver() && !jobs_set)
+		max_jobs = auto_jobs();
+
+	/* -j is the default per host, so after all options */
+	if (hosts_arg)
+		parse_hosts(hosts_arg);
+	if (hosts && cache_dir)
+		errx(1, "--cache can't be used with --hosts");
+	/* a signal would only reach ssh, see within.1 */
+	for (i = 0; job_timeout_secs && i < num_hosts; i++)
+		if (hosts[i].name)
+			errx(1, "--timeout can't be used with other hosts");
+
+	/* can't be had for free, see init_forwarding() */
+	use_pgroups = job_timeout_secs || halt_when == HALT_NOW;
+
+	if (sched_order == ORDER_LONGEST_FIRST && !history_path)
+		history_path = default_history_path();
+	if ((history_path || cache_dir || hosts) &&
+	    !(start_cwd = getcwd(NULL, 0)))
+		err(1, "getcwd");
+	if (history_path)
+		load_history();
+
+	if (input_path)
+		open_input(input_path);
+	else if (walk_marker)
+		start_walk();
 }
 
 static void
 usage(void)
 {
-	fprintf(stderr, "usage: within [-j jobs] directory [... -] command "
-	    "...\n");
+	fprintf(stderr,
+	    "usage: within [-j jobs|auto] [options] directory [... -] "
+	    "command ...\n"
+	    "       within [-0] [-j jobs] [options] -f file [directory ...] "
+	    "[-] command ...\n"
+	    "       within [-j jobs] [options] --find-marker name [root ...] "
+	    "[-] command ...\n");
 	exit(1);
 }
 
 static void
-start_job(const char *directory)
+open_input(const char *path)
 {
-	int stdout_pipe[2];
-	int stderr_pipe[2];
-	pid_t pid;
-	
-	if (pipe(stdout_pipe) == -1 || pipe(stderr_pipe) == -1)
-		err(1, "pipe");
-
-	switch ((pid = fork())) {
-	case -1:
-		err(1, "fork");
-
-	case 0:
-		if (dup2(stdout_pipe[1], STDOUT_FILENO) == -1)
-			err(1, "dup2 stdout");
-		if (dup2(stderr_pipe[1], STDERR_FILENO) == -1)
-			err(1, "dup2 stderr");
+	struct stat st;
 
-		close(stdout_pipe[0]);
-		close(stdout_pipe[1]);
-		close(stderr_pipe[0]);
-		close(stderr_pipe[1]);
+	if (!strcmp(path, "-")) {
+		input_fd = STDIN_FILENO;
+		input_stdin = true;
+	} else if ((input_fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+		err(1, "%s", path);
 
-		if (chdir(directory) == -1)
-			err(1, "chdir");
+	if (fstat(input_fd, &st) == -1)
+		err(1, "fstat");
 
-		execvp(command[0], command);
-		err(1, "%s", command[0]);
+	/* regular files don't block, and epoll won't take them anyway */
+	if (S_ISREG(st.st_mode))
+		return;
 
-	default:
-		close(stdout_pipe[1]);
-		close(stderr_pipe[1]);
+	if ((input_flags = fcntl(input_fd, F_GETFL)) == -1)
+		err(1, "F_GETFL");
+	if (fcntl(input_fd, F_SETFL, input_flags | O_NONBLOCK) == -1)
+		err(1, "F_SETFL");
 
-		start_piper(stdout_pipe[0], stdout, directory);
-		start_piper(stderr_pipe[0], stderr, directory);
-		break;
-	}
+	/* stdin may well be our shell's terminal */
+	atexit(restore_input);
 }
 
 static void
-start_piper(int in_fd, FILE *out_file, const char *prefix)
+restore_input(void)
 {
-	struct piper *piper;
-	int flags;
-	
-	if (!(piper = malloc(sizeof(*piper))))
-		err(1, "malloc");
-
-	memset(piper, 0, sizeof(*piper));
-	piper->in_fd = in_fd;
-	piper->out_file = out_file;
-	piper->prefix = prefix;
-	piper->newline = 1;
-
-	if ((flags = fcntl(in_fd, F_GETFL)) == -1)
-		err(1, "F_GETFL");
-	if (fcntl(in_fd, F_SETFL, flags | O_NONBLOCK) == -1)
-		err(1, "F_SETFL");
-
-	/* add to list */
-	piper->next = pipers;
-	pipers = piper;
+	fcntl(input_fd, F_SETFL, input_flags);
 }
 
-static void
-run_piper(struct piper *piper)
+/*
+ * Returns the next directory from the command line or input, or NULL if
+ * there are none left or, with -f, none available yet, in which case the
+ * input is registered with the event loop. Valid until the next call.
+ */
+static const char *
+read_directory(void)
 {
-	char buf[4096];
-	ssize_t num_read, i;
+	char *entry, *delim;
+	ssize_t nr;
+
+	if (next_arg < num_directories)
+		return directories[next_arg++];
+	if (input_fd == -1)
+		return NULL;
 
-	while ((num_read = read(piper->in_fd, buf, sizeof(buf))) > 0) {
-		for (i = 0; i < num_read; i++) {
-			if (piper->newline)
-				fprintf(piper->out_file, "%s: ",
-				    piper->prefix);
-			fputc(buf[i], piper->out_file);
-			piper->newline = buf[i] == '\n';
+	while (1) {
+		delim = memchr(input_buf + input_off, input_delim,
+		    input_len - input_off);
+
+		if (delim || (input_eof && input_off < input_len)) {
+			entry = input_buf + input_off;
+			if (delim) {
+				*delim = '\0';
+				input_off = (size_t)(delim - input_buf) + 1;
+			} else {
+				/* unterminated last entry, there's room */
+				input_buf[input_len] = '\0';
+				input_off = input_len;
+			}
+			if (*entry)
+				return entry;
+			continue;
 		}
-	}
 
+		if (input_eof)
+			return NULL;
+
+		/* make room, keeping the partial entry */
+		if (input_off) {
+			memmove(input_buf, input_buf + input_off,
+			    input_len - input_off);
+			input_len -= input_off;
+			input_off = 0;
+		}
+		if (input_cap - input_len < 4096) {
+			input_cap = input_cap ? input_cap*2 : 16384;
+			if (!(input_buf = realloc(input_buf, input_cap)))
+				err(1, "realloc");
+		}
+
+		/* leave a byte for the terminator */
+		nr = read(input_fd, input_buf + input_len,
+		    input_cap - input_len - 1);
+		if (nr > 0)
+			input_len += (size_t)nr;
+		else if (nr == 0)
+			input_eof = true;
+		else if (errno == EAGAIN) {
+			if (!input_watched) {
+				ev_add(input_fd, EV_READ, &input_fd);
+				input_watched = true;
+			}
+			return NULL;
+		} else if (errno != EINTR)
+			err(1, "read");
+	}
+}
+
+/* true if read_directory() will return more, now or later */
+static bool
+more_input(void)
+{
+	return next_arg < num_directories ||
+	    (input_fd != -1 && (!input_eof || input_off < input_len));
+}
+
+/*
+ * Returns the directory to start the next job in, or NULL if there's none
+ * (yet). In input order by default. With --order=longest-first, all
+ * directories that can be read without blocking are queued and the one
+ * with the longest recorded duration is returned, unknown ones first as
+ * they may well be slow. Valid until the next call.
+ */
+static const char *
+next_directory(void)
+{
+	static char *last;
+	const char *directory;
+
+	if (sched_order == ORDER_INPUT)
+		return read_directory();
+
+	free(last);
+	last = NULL;
+
+	while ((directory = read_directory()))
+		push_pending(directory);
+
+	if (!num_pending)
+		return NULL;
+
+	return last = pop_pending();
+}
+
+/* true if next_directory() will return more, now or later */
+static bool
+more_directories(void)
+{
+	if (deps_path)
+		return deps_left;
+	return num_pending || more_input();
+}
+
+static void
+push_pending(const char *directory)
+{
+	struct pending new;
+	size_t i;
+
+	if (num_pending == pending_cap) {
+		pending_cap = pending_cap ? pending_cap*2 : 256;
+		pending = realloc(pending, pending_cap * sizeof(*pending));
+		if (!pending)
+			err(1, "realloc");
+	}
+
+	if (!(new.directory = strdup(directory)))
+		err(1, "strdup");
+	new.expected = lookup_history(directory);
+	new.seq = pending_seq++;
+
+	/* sift up */
+	for (i = num_pending++; i; i = (i-1)/2) {
+		if (pending_cmp(&new, &pending[(i-1)/2]) >= 0)
+			break;
+		pending[i] = pending[(i-1)/2];
+	}
+
+	pending[i] = new;
+}
+
+/* removes the first pending directory, which the caller must free */
+static char *
+pop_pending(void)
+{
+	struct pending last;
+	char *directory;
+	size_t i, child;
+
+	directory = pending[0].directory;
+	last = pending[--num_pending];
+
+	/* sift down */
+	for (i = 0; (child = i*2+1) < num_pending; i = child) {
+		if (child+1 < num_pending &&
+		    pending_cmp(&pending[child+1], &pending[child]) < 0)
+			child++;
+		if (pending_cmp(&last, &pending[child]) <= 0)
+			break;
+		pending[i] = pending[child];
+	}
+
+	pending[i] = last;
+	return directory;
+}
+
+/* longest expected duration first, unknown (-1) before all, then by seq */
+static int
+pending_cmp(const struct pending *a, const struct pending *b)
+{
+	if ((a->expected < 0) != (b->expected < 0))
+		return a->expected < 0 ? -1 : 1;
+	if (a->expected != b->expected)
+		return a->expected > b->expected ? -1 : 1;
+	return (a->seq > b->seq) - (a->seq < b->seq);
+}
+
+/*
+ * The history file records how long jobs took, keyed by the hash of the
+ * command and the absolute directory:
+ *
+ *   <command hash>\t<seconds>\t<directory>
+ *
+ * Lines for other commands are kept as they are when the file is updated.
+ */
+static void
+load_history(void)
+{
+	FILE *f;
+	char *line = NULL, *p, *dir;
+	size_t cap = 0;
+	ssize_t len;
+	unsigned long long hash;
+	double secs;
+
+	history_cmd = hash_command();
+
+	if (!(f = fopen(history_path, "r"))) {
+		if (errno != ENOENT)
+			warn("%s", history_path);
+		return;
+	}
+
+	while ((len = getline(&line, &cap, f)) > 0) {
+		if (line[len-1] == '\n')
+			line[--len] = '\0';
+
+		hash = strtoull(line, &p, 16);
+		if (*p != '\t')
+			continue;
+		secs = strtod(p+1, &dir);
+		if (*dir++ != '\t' || !*dir)
+			continue;
+
+		if (hash == history_cmd)
+			set_history(dir, secs);
+		else {
+			/* someone else's, keep for save_history() */
+			if (num_history_other == history_other_cap) {
+				history_other_cap = history_other_cap ?
+				    history_other_cap*2 : 64;
+				history_other = realloc(history_other,
+				    history_other_cap *
+				    sizeof(*history_other));
+				if (!history_other)
+					err(1, "realloc");
+			}
+			if (!(history_other[num_history_other++] =
+			    strdup(line)))
+				err(1, "strdup");
+		}
+	}
+
+	if (ferror(f))
+		warn("%s", history_path);
+
+	free(line);
+	fclose(f);
+}
+
+/* atomically rewrites the history file with our updated durations */
+static void
+save_history(void)
+{
+	FILE *f;
+	char *tmp;
+	size_t i;
+
+	if (asprintf(&tmp, "%s.%ld", history_path, (long)getpid()) == -1)
+		err(1, "asprintf");
+
+	if (!(f = fopen(tmp, "w"))) {
+		warn("%s", tmp);
+		free(tmp);
+		return;
+	}
+
+	for (i = 0; i < num_history_other; i++)
+		fprintf(f, "%s\n", history_other[i]);
+	for (i = 0; i < history_cap; i++)
+		if (history[i].directory)
+			fprintf(f, "%016llx\t%.3f\t%s\n", history_cmd,
+			    history[i].secs, history[i].directory);
+
+	if (fclose(f) == EOF || rename(tmp, history_path) == -1) {
+		warn("%s", history_path);
+		unlink(tmp);
+	}
+
+	free(tmp);
+}
+
+/* returns the recorded duration for a directory, or -1 if unknown */
+static double
+lookup_history(const char *directory)
+{
+	struct history *h;
+
+	if (!history_cap)
+		return -1;
+
+	h = find_history(directory);
+	return h->directory ? h->secs : -1;
+}
+
+static void
+set_history(const char *directory, double secs)
+{
+	struct history *old, *h;
+	size_t old_cap, i;
+
+	/* never record names that would break our line format */
+	if (strchr(directory, '\n'))
+		return;
+
+	/* keep the load factor under 1/2 */
+	if (num_history*2 >= history_cap) {
+		old = history;
+		old_cap = history_cap;
+		history_cap = history_cap ? history_cap*2 : 1024;
+		if (!(history = calloc(history_cap, sizeof(*history))))
+			err(1, "calloc");
+		for (i = 0; i < old_cap; i++)
+			if (old[i].directory)
+				*find_history_abs(old[i].directory) = old[i];
+		free(old);
+	}
+
+	h = find_history(directory);
+	if (!h->directory) {
+		if (!(h->directory = absolute_path(directory)))
+			err(1, "malloc");
+		num_history++;
+	}
+	h->secs = secs;
+}
+
+/* finds the directory's slot, which may be empty, in the hash table */
+static struct history *
+find_history(const char *directory)
+{
+	static char *buf;
+	static size_t cap;
+	size_t len;
+
+	if (directory[0] == '/')
+		return find_history_abs(directory);
+
+	/* like absolute_path() but without the allocation */
+	len = strlen(start_cwd) + strlen(directory) + 2;
+	if (len > cap) {
+		cap = len*2;
+		if (!(buf = realloc(buf, cap)))
+			err(1, "realloc");
+	}
+	snprintf(buf, cap, "%s/%s", start_cwd, directory);
+
+	return find_history_abs(buf);
+}
+
+static struct history *
+find_history_abs(const char *path)
+{
+	size_t i;
+
+	i = hash_string(path, FNV_INIT) & (history_cap-1);
+	while (history[i].directory && strcmp(history[i].directory, path))
+		i = (i+1) & (history_cap-1);
+
+	return &history[i];
+}
+
+/* directory made absolute, without resolving symlinks or dots */
+static char *
+absolute_path(const char *directory)
+{
+	char *path;
+
+	if (directory[0] == '/')
+		return strdup(directory);
+	if (asprintf(&path, "%s/%s", start_cwd, directory) == -1)
+		return NULL;
+	return path;
+}
+
+/* $XDG_CACHE_HOME/within/history, creating the directories */
+static const char *
+default_history_path(void)
+{
+	const char *base, *home;
+	char *dir, *path;
+
+	if (!(base = getenv("XDG_CACHE_HOME")) || !*base) {
+		if (!(home = getenv("HOME")))
+			errx(1, "no HOME, specify --history");
+		if (asprintf(&dir, "%s/.cache", home) == -1)
+			err(1, "asprintf");
+		mkdir(dir, 0700);
+	} else if (!(dir = strdup(base)))
+		err(1, "strdup");
+
+	if (asprintf(&path, "%s/within", dir) == -1)
+		err(1, "asprintf");
+	mkdir(path, 0755);
+	free(path);
+
+	if (asprintf(&path, "%s/within/history", dir) == -1)
+		err(1, "asprintf");
+	free(dir);
+
+	return path;
+}
+
+/* FNV-1a, pass FNV_INIT or the previous hash to continue */
+static unsigned long long
+hash_string(const char *s, unsigned long long hash)
+{
+	for (; *s; s++) {
+		hash ^= (unsigned char)*s;
+		hash *= FNV_PRIME;
+	}
+
+	return hash;
+}
+
+/* hash of the command arguments, NUL included to separate them */
+static unsigned long long
+hash_command(void)
+{
+	unsigned long long hash = FNV_INIT;
+	char **arg;
+
+	for (arg = command; *arg; arg++)
+		hash = hash_string(*arg, hash) * FNV_PRIME;
+
+	return hash;
+}
+
+/* continues a hash with the 8 bytes of v, like hash_string() */
+static unsigned long long
+hash_ull(unsigned long long v, unsigned long long hash)
+{
+	int i;
+
+	for (i = 0; i < 8; i++, v >>= 8) {
+		hash ^= v & 0xff;
+		hash *= FNV_PRIME;
+	}
+
+	return hash;
+}
+
+/*
+ * --cache keeps the output of jobs that exited 0 in a file per command and
+ * absolute directory, named by their hash:
+ *
+ *   "within-cache 1\n" <fingerprint, 16 hex digits> "\n"
+ *   <absolute directory> NUL
+ *   <stream> <length, 4 bytes little endian> <output>  (repeated)
+ *
+ * The fingerprint is taken when the job is done and both its output pipes
+ * are closed, see fingerprint(). Before running a directory it's taken
+ * again. If it matches, the stored output is replayed rather than running
+ * the command. Fingerprinting can take a while on large trees, so a few
+ * threads do it and the file I/O from cache_todo. They put the finished
+ * requests on cache_done and wake the event loop through cache_pipe.
+ */
+static void
+start_cache(void)
+{
+	pthread_t thread;
+	struct stat st;
+	int flags, i;
+
+	if (mkdir(cache_dir, 0777) == -1 && errno != EEXIST)
+		err(1, "%s", cache_dir);
+	if (stat(cache_dir, &st) == -1)
+		err(1, "%s", cache_dir);
+	cache_dev = st.st_dev;
+	cache_ino = st.st_ino;
+	cache_cmd = hash_command();
+
+	make_pipe(cache_pipe);
+	if ((flags = fcntl(cache_pipe[0], F_GETFL)) == -1 ||
+	    fcntl(cache_pipe[0], F_SETFL, flags | O_NONBLOCK) == -1)
+		err(1, "fcntl");
+	ev_add(cache_pipe[0], EV_READ, cache_pipe);
+
+	for (i = 0; i < CACHE_THREADS; i++) {
+		if ((errno = pthread_create(&thread, NULL, cache_thread,
+		    NULL)))
+			err(1, "pthread_create");
+		pthread_detach(thread);
+	}
+}
+
+static void *
+cache_thread(void *arg)
+{
+	struct cache_req *req;
+	char c = 0;
+
+	(void)arg;
+
+	while (1) {
+		pthread_mutex_lock(&cache_lock);
+		while (!cache_todo)
+			pthread_cond_wait(&cache_cond, &cache_lock);
+		req = cache_todo;
+		if (!(cache_todo = req->next))
+			cache_todo_tail = &cache_todo;
+		pthread_mutex_unlock(&cache_lock);
+
+		if (req->entry)
+			cache_store(req);
+		else
+			cache_check(req);
+
+		pthread_mutex_lock(&cache_lock);
+		req->next = cache_done;
+		cache_done = req;
+		pthread_mutex_unlock(&cache_lock);
+
+		while (write(cache_pipe[1], &c, 1) == -1 && errno == EINTR)
+			;
+	}
+
+	return NULL;
+}
+
+static void
+cache_submit(struct cache_req *req)
+{
+	req->next = NULL;
+
+	pthread_mutex_lock(&cache_lock);
+	*cache_todo_tail = req;
+	cache_todo_tail = &req->next;
+	pthread_cond_signal(&cache_cond);
+	pthread_mutex_unlock(&cache_lock);
+
+	cache_waiting++;
+}
+
+/* has the next few directories checked, ahead of the free job slots */
+static void
+cache_fill(void)
+{
+	struct cache_req *req;
+	const char *directory;
+
+	while (!halting && cache_checking < (size_t)max_jobs + CACHE_THREADS &&
+	    (directory = next_directory())) {
+		if (!(req = calloc(1, sizeof(*req))) ||
+		    !(req->directory = strdup(directory)))
+			err(1, "malloc");
+		req->fd = -1;
+		cache_checking++;
+		cache_submit(req);
+	}
+}
+
+/*
+ * Like next_directory() but for --cache, returning checked directories
+ * that have to be run. Valid until the next call.
+ */
+static const char *
+cache_next(void)
+{
+	static char *last;
+	struct cache_req *req;
+
+	free(last);
+	last = NULL;
+
+	if (!(req = cache_ready))
+		return NULL;
+	if (!(cache_ready = req->next))
+		cache_ready_tail = &cache_ready;
+	cache_checking--;
+
+	last = req->directory;
+	free(req);
+	return last;
+}
+
+/* takes the threads' finished requests, replaying or queueing checks */
+static void
+cache_collect(void)
+{
+	struct cache_req *done, *req, *next;
+	struct cache_entry *entry;
+	char buf[64];
+
+	while (read(cache_pipe[0], buf, sizeof(buf)) > 0)
+		;
+
+	pthread_mutex_lock(&cache_lock);
+	done = cache_done;
+	cache_done = NULL;
+	pthread_mutex_unlock(&cache_lock);
+
+	/* reverse the stack, into the order they were done in */
+	for (req = NULL; done; done = next) {
+		next = done->next;
+		done->next = req;
+		req = done;
+	}
+
+	for (; req; req = next) {
+		next = req->next;
+		cache_waiting--;
+
+		if ((entry = req->entry)) {
+			cache_storing--;
+			free(entry->directory);
+			free(entry->tmp);
+			free(entry);
+		} else if (halting) {
+			cache_checking--;
+			if (req->fd != -1)
+				close(req->fd);
+		} else if (req->fd != -1) {
+			cache_checking--;
+			num_started++;
+			num_cached++;
+			cache_replay(req);
+		} else {
+			req->next = NULL;
+			*cache_ready_tail = req;
+			cache_ready_tail = &req->next;
+			continue;
+		}
+
+		free(req->directory);
+		free(req);
+	}
+}
+
+/* on a thread: opens the cached output if the fingerprint still matches */
+static void
+cache_check(struct cache_req *req)
+{
+	const size_t fp_off = sizeof(CACHE_MAGIC)-1;
+	const size_t dir_off = fp_off + 17;
+	unsigned long long stored, fp;
+	char *abs, *path, *buf, *end;
+	size_t len;
+	int fd;
+
+	if (!(abs = absolute_path(req->directory)))
+		err(1, "malloc");
+	path = cache_path(abs);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	free(path);
+	if (fd == -1) {
+		free(abs);
+		return;
+	}
+
+	len = dir_off + strlen(abs) + 1;
+	if (!(buf = malloc(len)))
+		err(1, "malloc");
+
+	/* leaves fd at the first record */
+	if (read(fd, buf, len) != (ssize_t)len ||
+	    memcmp(buf, CACHE_MAGIC, fp_off) ||
+	    buf[dir_off-1] != '\n' || memcmp(buf + dir_off, abs, len - dir_off))
+		goto miss;
+
+	buf[dir_off-1] = '\0';
+	stored = strtoull(buf + fp_off, &end, 16);
+	if (*end || !fingerprint(abs, &fp) || fp != stored)
+		goto miss;
+
+	req->fd = fd;
+	free(buf);
+	free(abs);
+	return;
+
+miss:
+	close(fd);
+	free(buf);
+	free(abs);
+}
+
+/* on a thread: fingerprints the directory, moving the entry into place */
+static void
+cache_store(struct cache_req *req)
+{
+	struct cache_entry *entry = req->entry;
+	unsigned long long fp;
+	char head[sizeof(CACHE_MAGIC)-1 + 18];
+	char *abs, *path;
+	int len;
+
+	if (!(abs = absolute_path(entry->directory)))
+		err(1, "malloc");
+	path = cache_path(abs);
+
+	if (!fingerprint(abs, &fp)) {
+		close(entry->fd);
+		unlink(entry->tmp);
+	} else {
+		len = snprintf(head, sizeof(head), CACHE_MAGIC "%016llx\n",
+		    fp);
+		if (pwrite(entry->fd, head, (size_t)len, 0) != len ||
+		    close(entry->fd) == -1 || rename(entry->tmp, path) == -1) {
+			warn("%s", path);
+			unlink(entry->tmp);
+		}
+	}
+
+	free(path);
+	free(abs);
+}
+
+/* writes out cached output as the job would have, through a group */
+static void
+cache_replay(struct cache_req *req)
+{
+	struct piper pipers[2];
+	struct group *group;
+	unsigned char head[5];
+	char buf[65536];
+	char *prefix = NULL, *record;
+	size_t len, prefix_len, prefix_cap = 0;
+	FILE *f;
+	int i;
+
+	if (!(f = fdopen(req->fd, "r")))
+		err(1, "fdopen");
+	if (out_format == FORMAT_JSONL)
+		prefix_len = json_prefix(&prefix, &prefix_cap, req->directory,
+		    NULL);
+	else if (asprintf(&prefix, "%s: ", req->directory) == -1)
+		err(1, "asprintf");
+	else
+		prefix_len = strlen(prefix);
+
+	group = new_group();
+	memset(pipers, 0, sizeof(pipers));
+	for (i = 0; i < 2; i++) {
+		pipers[i].in_fd = -1;
+		pipers[i].newline = 1;
+		/* JSON lines all go to stdout */
+		pipers[i].hold = &group->out[out_format == FORMAT_JSONL ?
+		    0 : i];
+		pipers[i].prefix = prefix;
+		pipers[i].prefix_len = prefix_len;
+		pipers[i].stream = i;
+	}
+
+	if (out_format == FORMAT_JSONL) {
+		record = json_event(prefix, prefix_len, &len,
+		    "\"start\",\"time\":%.6f,\"cached\":true",
+		    now() - json_epoch);
+		json_emit(group, record, len);
+	}
+
+	while (fread(head, 1, sizeof(head), f) == sizeof(head)) {
+		len = (size_t)head[1] | (size_t)head[2] << 8 |
+		    (size_t)head[3] << 16 | (size_t)head[4] << 24;
+		if (head[0] > 1 || len > sizeof(buf) ||
+		    fread(buf, 1, len, f) != len) {
+			warnx("%s: bad cache entry", req->directory);
+			break;
+		}
+		piper_feed(&pipers[head[0]], buf, len);
+	}
+
+	if (ferror(f))
+		warn("%s: cache", req->directory);
+
+	if (out_format == FORMAT_JSONL) {
+		for (i = 0; i < 2; i++) {
+			json_eof(&pipers[i]);
+			free(pipers[i].part);
+		}
+		/* only successful runs are cached */
+		record = json_event(prefix, prefix_len, &len,
+		    "\"exit\",\"time\":%.6f,\"status\":0,\"cached\":true",
+		    now() - json_epoch);
+		json_emit(group, record, len);
+	}
+
+	fclose(f);
+	free(prefix);
+	release_group(group);
+}
+
+/* cache_dir/<hash>, to be freed */
+static char *
+cache_path(const char *abs)
+{
+	char *path;
+
+	if (asprintf(&path, "%s/%016llx", cache_dir,
+	    hash_string(abs, cache_cmd)) == -1)
+		err(1, "asprintf");
+
+	return path;
+}
+
+/* starts recording a job's output, or returns NULL if that can't be done */
+static struct cache_entry *
+cache_start(const char *directory)
+{
+	struct cache_entry *entry;
+	struct iovec iov[2];
+	char *abs;
+
+	if (!(entry = calloc(1, sizeof(*entry))) ||
+	    !(entry->directory = strdup(directory)) ||
+	    !(abs = absolute_path(directory)) ||
+	    asprintf(&entry->tmp, "%s/.within.XXXXXX", cache_dir) == -1)
+		err(1, "malloc");
+
+	if ((entry->fd = mkstemp(entry->tmp)) == -1) {
+		warn("%s", entry->tmp);
+		free(entry->directory);
+		free(entry->tmp);
+		free(entry);
+		free(abs);
+		return NULL;
+	}
+	fcntl(entry->fd, F_SETFD, FD_CLOEXEC);
+
+	/* the fingerprint is filled in by cache_store() */
+	iov[0].iov_base = CACHE_MAGIC "................\n";
+	iov[0].iov_len = sizeof(CACHE_MAGIC)-1 + 17;
+	iov[1].iov_base = abs;
+	iov[1].iov_len = strlen(abs) + 1;
+	write_all(entry->fd, iov, 2);
+	free(abs);
+
+	entry->refs = 1;	/* the job's */
+	return entry;
+}
+
+/* appends a chunk of the job's output, stream 0 for stdout, 1 for stderr */
+static void
+cache_record(struct cache_entry *entry, int stream, const char *buf,
+    size_t len)
+{
+	unsigned char head[5];
+	struct iovec iov[2];
+
+	head[0] = (unsigned char)stream;
+	head[1] = len & 0xff;
+	head[2] = (len >> 8) & 0xff;
+	head[3] = (len >> 16) & 0xff;
+	head[4] = (len >> 24) & 0xff;
+
+	iov[0].iov_base = head;
+	iov[0].iov_len = sizeof(head);
+	iov[1].iov_base = (char *)buf;
+	iov[1].iov_len = len;
+	write_all(entry->fd, iov, 2);
+}
+
+/* drops a reference, keeping the entry once the job and pipers are done */
+static void
+cache_release(struct cache_entry *entry)
+{
+	struct cache_req *req;
+
+	if (--entry->refs)
+		return;
+
+	if (!entry->ok) {
+		close(entry->fd);
+		unlink(entry->tmp);
+		free(entry->directory);
+		free(entry->tmp);
+		free(entry);
+		return;
+	}
+
+	if (!(req = calloc(1, sizeof(*req))))
+		err(1, "calloc");
+	req->entry = entry;
+	req->fd = -1;
+	cache_storing++;
+	cache_submit(req);
+}
+
+/*
+ * Hashes the names, types, sizes and modification times of everything
+ * under the directory, sorted so the order readdir() gives doesn't matter.
+ * The cache directory itself is left out, and of .git only what
+ * fingerprint_git() picks.
+ */
+static bool
+fingerprint(const char *directory, unsigned long long *fp)
+{
+	int fd;
+
+	if ((fd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+		return false;
+
+	*fp = fingerprint_dir(fd, FNV_INIT);
+	return true;
+}
+
+/* continues the hash with the directory open on fd, which is closed */
+static unsigned long long
+fingerprint_dir(int fd, unsigned long long hash)
+{
+	DIR *dir;
+	struct dirent *dent;
+	struct stat st;
+	char **names = NULL;
+	size_t num = 0, cap = 0, i;
+	bool git = false;
+	long nsec;
+	int sub;
+
+	if (!(dir = fdopendir(fd))) {
+		close(fd);
+		return hash;
+	}
+
+	while ((dent = readdir(dir))) {
+		if (!strcmp(dent->d_name, ".git"))
+			git = true;
+		if (!strcmp(dent->d_name, ".") || !strcmp(dent->d_name, "..") ||
+		    !strcmp(dent->d_name, ".git"))
+			continue;
+		if (num == cap) {
+			cap = cap ? cap*2 : 64;
+			if (!(names = realloc(names, cap * sizeof(*names))))
+				err(1, "realloc");
+		}
+		if (!(names[num++] = strdup(dent->d_name)))
+			err(1, "strdup");
+	}
+
+	qsort(names, num, sizeof(*names), cmp_name);
+
+	for (i = 0; i < num; i++) {
+		if (fstatat(fd, names[i], &st, AT_SYMLINK_NOFOLLOW) == -1 ||
+		    (st.st_dev == cache_dev && st.st_ino == cache_ino)) {
+			free(names[i]);
+			continue;
+		}
+
+		hash = hash_string(names[i], hash) * FNV_PRIME;
+		hash = hash_ull((unsigned long long)st.st_mode, hash);
+
+		if (S_ISDIR(st.st_mode)) {
+			sub = openat(fd, names[i], O_RDONLY | O_DIRECTORY |
+			    O_NOFOLLOW | O_CLOEXEC);
+			if (sub != -1)
+				hash = fingerprint_dir(sub, hash);
+			/* names can't have slashes, so this ends the list */
+			hash = hash_string("/", hash) * FNV_PRIME;
+		} else {
+#if defined(__APPLE__)
+			nsec = st.st_mtimespec.tv_nsec;
+#else
+			nsec = st.st_mtim.tv_nsec;
+#endif
+			hash = hash_ull((unsigned long long)st.st_size, hash);
+			hash = hash_ull((unsigned long long)st.st_mtime, hash);
+			hash = hash_ull((unsigned long long)nsec, hash);
+		}
+
+		free(names[i]);
+	}
+
+	if (git)
+		hash = fingerprint_git(fd, hash);
+
+	free(names);
+	closedir(dir);
+
+	return hash;
+}
+
+/*
+ * Walking the object store would take long, but what a git command shows
+ * also depends on what's checked out and staged. So continues the hash
+ * with the HEAD, the ref it points to (or packed-refs) and the index of
+ * the repository at .git in the directory on fd. A .git file, as in
+ * worktrees and submodules, points to it with "gitdir: <path>".
+ */
+static unsigned long long
+fingerprint_git(int fd, unsigned long long hash)
+{
+	struct stat st;
+	char buf[PATH_MAX], *ref;
+	int git, common;
+	long nsec;
+
+	if ((git = openat(fd, ".git", O_RDONLY | O_DIRECTORY |
+	    O_CLOEXEC)) == -1) {
+		if (!hash_file(fd, ".git", &hash, buf, sizeof(buf)) ||
+		    strncmp(buf, "gitdir: ", 8))
+			return hash;
+		buf[strcspn(buf, "\n")] = '\0';
+		if ((git = openat(fd, buf+8, O_RDONLY | O_DIRECTORY |
+		    O_CLOEXEC)) == -1)
+			return hash;
+	}
+
+	/* a worktree's branches are in the main repository's */
+	common = -1;
+	if (hash_file(git, "commondir", &hash, buf, sizeof(buf))) {
+		buf[strcspn(buf, "\n")] = '\0';
+		common = openat(git, buf, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	}
+
+	if (hash_file(git, "HEAD", &hash, buf, sizeof(buf)) &&
+	    !strncmp(buf, "ref: ", 5)) {
+		ref = buf+5;
+		ref[strcspn(ref, "\n")] = '\0';
+		if (!hash_file(git, ref, &hash, NULL, 0) &&
+		    !hash_file(git, "packed-refs", &hash, NULL, 0) &&
+		    common != -1 &&
+		    !hash_file(common, ref, &hash, NULL, 0))
+			hash_file(common, "packed-refs", &hash, NULL, 0);
+	}
+
+	/* git add changes the index, but nothing else */
+	if (fstatat(git, "index", &st, 0) != -1) {
+#if defined(__APPLE__)
+		nsec = st.st_mtimespec.tv_nsec;
+#else
+		nsec = st.st_mtim.tv_nsec;
+#endif
+		hash = hash_ull((unsigned long long)st.st_size, hash);
+		hash = hash_ull((unsigned long long)st.st_mtime, hash);
+		hash = hash_ull((unsigned long long)nsec, hash);
+		hash_file(git, "index", &hash, NULL, 0);
+	}
+
+	if (common != -1)
+		close(common);
+	close(git);
+
+	return hash;
+}
+
+/*
+ * Continues *hash with the contents of the file, a NUL to end them, and
+ * copies the start of it to buf as a string if buf isn't NULL. Returns
+ * false if it can't be read.
+ */
+static bool
+hash_file(int dirfd, const char *name, unsigned long long *hash,
+    char *buf, size_t size)
+{
+	char data[65536];
+	size_t len = 0;
+	ssize_t nr, i;
+	int fd;
+
+	if ((fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC)) == -1)
+		return false;
+
+	while ((nr = read(fd, data, sizeof(data))) > 0) {
+		for (i = 0; i < nr; i++) {
+			*hash ^= (unsigned char)data[i];
+			*hash *= FNV_PRIME;
+		}
+		if (buf && len < size-1) {
+			memcpy(buf+len, data, MIN((size_t)nr, size-1-len));
+			len += MIN((size_t)nr, size-1-len);
+		}
+	}
+
+	close(fd);
+	if (nr == -1)
+		return false;
+
+	*hash *= FNV_PRIME;
+	if (buf)
+		buf[len] = '\0';
+	return true;
+}
+
+/* orders strings, for qsort() */
+static int
+cmp_name(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/*
+ * Starts the --find-marker walk over the directories given on the command
+ * line, or the current directory, which then aren't run in themselves.
+ */
+static void
+start_walk(void)
+{
+	pthread_t thread;
+	char *root;
+	int fds[2];
+	int flags, i;
+
+	for (i = 0; i < MAX(num_directories, 1); i++) {
+		/* freed by walk_thread() */
+		root = strdup(num_directories ? directories[i] : ".");
+		if (!root)
+			err(1, "strdup");
+		walk_push(root);
+	}
+
+	num_directories = 0;
+
+	make_pipe(fds);
+	input_fd = fds[0];
+	input_delim = '\0';
+	walk_fd = fds[1];
+
+	if ((flags = fcntl(input_fd, F_GETFL)) == -1 ||
+	    fcntl(input_fd, F_SETFL, flags | O_NONBLOCK) == -1)
+		err(1, "fcntl");
+
+	for (i = 0; i < WALK_THREADS; i++) {
+		if ((errno = pthread_create(&thread, NULL, walk_thread, NULL)))
+			err(1, "pthread_create");
+		pthread_detach(thread);
+	}
+}
+
+static void *
+walk_thread(void *arg)
+{
+	char *path;
+
+	(void)arg;
+
+	pthread_mutex_lock(&walk_lock);
+
+	while (1) {
+		while (!walk_len && walk_busy)
+			pthread_cond_wait(&walk_cond, &walk_lock);
+		if (!walk_len)
+			break;
+
+		path = walk_stack[--walk_len];
+		walk_busy++;
+		pthread_mutex_unlock(&walk_lock);
+
+		walk_dir(path);
+		free(path);
+
+		pthread_mutex_lock(&walk_lock);
+		walk_busy--;
+	}
+
+	/* nothing left to scan and nobody scanning, we're done */
+	if (walk_fd != -1) {
+		close(walk_fd);
+		walk_fd = -1;
+	}
+
+	pthread_cond_broadcast(&walk_cond);
+	pthread_mutex_unlock(&walk_lock);
+
+	return NULL;
+}
+
+/*
+ * Emits path if it contains an entry matching the marker, and queues its
+ * subdirectories except for the marker itself. Symlinks aren't followed.
+ */
+static void
+walk_dir(const char *path)
+{
+	DIR *dir;
+	struct dirent *dent;
+	struct stat st;
+	bool is_dir, matched = false;
+	char *sub;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd == -1) {
+		warn("%s", path);
+		return;
+	}
+	if (!(dir = fdopendir(fd))) {
+		warn("%s", path);
+		close(fd);
+		return;
+	}
+
+	while ((dent = readdir(dir))) {
+		if (!strcmp(dent->d_name, ".") || !strcmp(dent->d_name, ".."))
+			continue;
+
+		if (!fnmatch(walk_marker, dent->d_name, FNM_PERIOD)) {
+			matched = true;
+			continue;
+		}
+
+#if defined(DT_DIR)
+		if (dent->d_type != DT_UNKNOWN)
+			is_dir = dent->d_type == DT_DIR;
+		else
+#endif
+		is_dir = !fstatat(fd, dent->d_name, &st, AT_SYMLINK_NOFOLLOW) &&
+		    S_ISDIR(st.st_mode);
+		if (!is_dir)
+			continue;
+
+		if (!strcmp(path, "."))
+			sub = strdup(dent->d_name);
+		else if (asprintf(&sub, "%s/%s", path, dent->d_name) == -1)
+			sub = NULL;
+		if (!sub)
+			err(1, "malloc");
+
+		pthread_mutex_lock(&walk_lock);
+		walk_push(sub);
+		pthread_cond_signal(&walk_cond);
+		pthread_mutex_unlock(&walk_lock);
+	}
+
+	closedir(dir);
+
+	if (matched)
+		walk_emit(path);
+}
+
+/* call with walk_lock held, or before the threads are started */
+static void
+walk_push(char *path)
+{
+	if (walk_len == walk_cap) {
+		walk_cap = walk_cap ? walk_cap*2 : 256;
+		walk_stack = realloc(walk_stack,
+		    walk_cap * sizeof(*walk_stack));
+		if (!walk_stack)
+			err(1, "realloc");
+	}
+
+	walk_stack[walk_len++] = path;
+}
+
+/* writes path to the input pipe, blocking if the scheduler isn't keeping up */
+static void
+walk_emit(const char *path)
+{
+	struct iovec iov[2];
+
+	iov[0].iov_base = (char *)path;
+	iov[0].iov_len = strlen(path);
+	iov[1].iov_base = "";
+	iov[1].iov_len = 1;
+
+	/* records may exceed PIPE_BUF, keep them whole */
+	pthread_mutex_lock(&walk_out_lock);
+	write_all(walk_fd, iov, 2);
+	pthread_mutex_unlock(&walk_out_lock);
+}
+
+/*
+ * --deps: a file of "directory: dependency ..." lines. The directories to
+ * run are those from the command line and -f or, if there are none, all
+ * that are in the file. Instead of in input order, directories are taken
+ * from a queue of those whose dependencies have succeeded, each queued
+ * the moment its last one does. Dependencies that aren't run count as
+ * done; the dependents of a failed directory are skipped.
+ *
+ * All input is read up front, as the whole graph is needed to find those
+ * that can start.
+ */
+static void
+start_deps(void)
+{
+	struct dep_node *node, **queue;
+	struct pollfd pfd;
+	const char *directory;
+	size_t i, j, head, tail;
+
+	load_deps();
+
+	while (more_input()) {
+		if ((directory = read_directory())) {
+			add_dep_input(directory);
+			continue;
+		}
+		pfd.fd = input_fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, -1) == -1 && errno != EINTR)
+			err(1, "poll");
+	}
+	if (input_watched) {
+		ev_del(input_fd, EV_READ);
+		input_watched = false;
+	}
+
+	/* nothing given, run the lot */
+	if (!num_dep_runs)
+		for (i = 0; i < num_dep_nodes; i++)
+			add_dep_input(dep_nodes[i]->directory);
+
+	for (i = 0; i < num_dep_nodes; i++) {
+		node = dep_nodes[i];
+		if (!node->run)
+			continue;
+		for (j = 0; j < node->num_dependents; j++)
+			if (node->dependents[j]->run)
+				node->dependents[j]->waiting++;
+	}
+
+	/* Kahn's algorithm on a copy, to report cycles before starting */
+	if (!(queue = calloc(num_dep_runs, sizeof(*queue))))
+		err(1, "calloc");
+	for (i = 0, tail = 0; i < num_dep_runs; i++) {
+		dep_runs[i]->left = dep_runs[i]->waiting;
+		if (!dep_runs[i]->left)
+			queue[tail++] = dep_runs[i];
+	}
+	for (head = 0; head < tail; head++)
+		for (j = 0; j < queue[head]->num_dependents; j++) {
+			node = queue[head]->dependents[j];
+			if (node->run && !--node->left)
+				queue[tail++] = node;
+		}
+	free(queue);
+	if (tail < num_dep_runs)
+		for (i = 0; i < num_dep_runs; i++)
+			if (dep_runs[i]->left)
+				errx(1, "%s: dependency cycle in %s",
+				    dep_runs[i]->directory, deps_path);
+
+	deps_left = num_dep_runs;
+	for (i = 0; i < num_dep_runs; i++)
+		if (!dep_runs[i]->waiting)
+			push_ready(dep_runs[i]);
+}
+
+/* reads the --deps file into dep_nodes */
+static void
+load_deps(void)
+{
+	struct dep_node *node, *dep;
+	FILE *f;
+	char *line = NULL, *p, *colon, *name;
+	size_t cap = 0, lineno = 0;
+
+	if (!(f = fopen(deps_path, "r")))
+		err(1, "%s", deps_path);
+
+	while (getline(&line, &cap, f) != -1) {
+		lineno++;
+		if ((p = strchr(line, '#')))
+			*p = '\0';
+		line[strcspn(line, "\n")] = '\0';
+		if (!line[strspn(line, " \t")])
+			continue;
+
+		if (!(colon = strchr(line, ':')))
+			errx(1, "%s:%zu: missing ':'", deps_path, lineno);
+		*colon = '\0';
+
+		p = line;
+		if (!(name = strtok(p, " \t")) || strtok(NULL, " \t"))
+			errx(1, "%s:%zu: expected one directory before ':'",
+			    deps_path, lineno);
+		node = find_dep(name);
+
+		for (p = strtok(colon+1, " \t"); p; p = strtok(NULL, " \t")) {
+			dep = find_dep(p);
+			if (dep->num_dependents == dep->dependents_cap) {
+				dep->dependents_cap = dep->dependents_cap ?
+				    dep->dependents_cap*2 : 4;
+				if (!(dep->dependents = realloc(dep->dependents,
+				    dep->dependents_cap *
+				    sizeof(*dep->dependents))))
+					err(1, "realloc");
+			}
+			dep->dependents[dep->num_dependents++] = node;
+		}
+	}
+
+	if (ferror(f))
+		err(1, "%s", deps_path);
+	fclose(f);
+	free(line);
+}
+
+/* marks a directory as one to run, once, in input order */
+static void
+add_dep_input(const char *directory)
+{
+	struct dep_node *node;
+
+	node = find_dep(directory);
+	if (node->run)
+		return;
+	node->run = true;
+
+	if (num_dep_runs == dep_runs_cap) {
+		dep_runs_cap = dep_runs_cap ? dep_runs_cap*2 : 64;
+		if (!(dep_runs = realloc(dep_runs, dep_runs_cap *
+		    sizeof(*dep_runs))))
+			err(1, "realloc");
+	}
+	dep_runs[num_dep_runs++] = node;
+}
+
+/*
+ * Returns the node for a directory, creating it if there's none. Trailing
+ * slashes and leading "./" don't matter. Open addressing, like history.
+ */
+static struct dep_node *
+find_dep(const char *directory)
+{
+	struct dep_node **old, **slot, *node;
+	size_t old_cap, len, i;
+
+	while (directory[0] == '.' && directory[1] == '/')
+		for (directory += 2; *directory == '/'; directory++)
+			;
+	for (len = strlen(directory); len > 1 && directory[len-1] == '/';
+	    len--)
+		;
+
+	if (num_dep_nodes*2 >= dep_table_cap) {
+		old = dep_table;
+		old_cap = dep_table_cap;
+		dep_table_cap = dep_table_cap ? dep_table_cap*2 : 256;
+		if (!(dep_table = calloc(dep_table_cap, sizeof(*dep_table))))
+			err(1, "calloc");
+		for (i = 0; i < old_cap; i++)
+			if (old[i]) {
+				slot = dep_slot(old[i]->directory,
+				    strlen(old[i]->directory));
+				*slot = old[i];
+			}
+		free(old);
+	}
+
+	slot = dep_slot(directory, len);
+	if (*slot)
+		return *slot;
+
+	if (!(node = calloc(1, sizeof(*node))) ||
+	    !(node->directory = strndup(directory, len)))
+		err(1, "malloc");
+	*slot = node;
+
+	if (num_dep_nodes == dep_nodes_cap) {
+		dep_nodes_cap = dep_nodes_cap ? dep_nodes_cap*2 : 64;
+		if (!(dep_nodes = realloc(dep_nodes, dep_nodes_cap *
+		    sizeof(*dep_nodes))))
+			err(1, "realloc");
+	}
+	dep_nodes[num_dep_nodes++] = node;
+
+	return node;
+}
+
+/* the slot for the directory, or the empty one where it would go */
+static struct dep_node **
+dep_slot(const char *directory, size_t len)
+{
+	unsigned long long hash = FNV_INIT;
+	size_t i, j;
+
+	for (j = 0; j < len; j++) {
+		hash ^= (unsigned char)directory[j];
+		hash *= FNV_PRIME;
+	}
+
+	for (i = hash & (dep_table_cap-1); dep_table[i];
+	    i = (i+1) & (dep_table_cap-1))
+		if (!strncmp(dep_table[i]->directory, directory, len) &&
+		    !dep_table[i]->directory[len])
+			break;
+
+	return &dep_table[i];
+}
+
+static void
+push_ready(struct dep_node *node)
+{
+	node->next = NULL;
+	*dep_ready_tail = node;
+	dep_ready_tail = &node->next;
+}
+
+/* the next directory whose dependencies are done, for next_job() */
+static const char *
+deps_next(void)
+{
+	struct dep_node *node;
+
+	if (!(node = dep_ready))
+		return NULL;
+	if (!(dep_ready = node->next))
+		dep_ready_tail = &dep_ready;
+
+	deps_left--;
+	dep_taken = node;
+	return node->directory;
+}
+
+/* queues the dependents that can now run, or skips them if !ok */
+static void
+finish_dep(struct dep_node *node, bool ok)
+{
+	struct dep_node *dep;
+	size_t i;
+
+	if (!ok) {
+		skip_deps(node, node->directory);
+		return;
+	}
+
+	for (i = 0; i < node->num_dependents; i++) {
+		dep = node->dependents[i];
+		if (dep->run && !dep->skipped && !--dep->waiting)
+			push_ready(dep);
+	}
+}
+
+/* skips everything that depends on node, directly or not */
+static void
+skip_deps(struct dep_node *node, const char *failed)
+{
+	struct dep_node *dep;
+	size_t i;
+
+	for (i = 0; i < node->num_dependents; i++) {
+		dep = node->dependents[i];
+		if (!dep->run || dep->skipped)
+			continue;
+		warnx("%s: skipped, %s failed", dep->directory, failed);
+		dep->skipped = true;
+		deps_left--;
+		skip_deps(dep, failed);
+	}
+}
+
+/*
+ * Returns what to start the next job on, or NULL if there's nothing (yet).
+ * That's the directory, or with -n a "first..last" label for the batch of
+ * directories in batch. A batch is started before it's full only when
+ * there's nothing running or no more input to wait for. Valid until the
+ * next call.
+ */
+static const char *
+next_job(int num_jobs)
+{
+	static char *label;
+	const char *directory;
+	size_t i;
+
+	/* retries first, they've waited long enough */
+	if ((retry_taken = retry_ready)) {
+		if (!(retry_ready = retry_taken->next))
+			retry_ready_tail = &retry_ready;
+		dep_taken = retry_taken->node;
+		return retry_taken->directory;
+	}
+	if (cache_dir)
+		return cache_next();
+	if (deps_path)
+		return deps_next();
+	if (batch_size == 1)
+		return next_directory();
+
+	if (batch_taken) {
+		for (i = 0; i < batch_len; i++)
+			free(batch[i]);
+		batch_len = 0;
+		batch_taken = false;
+	}
+
+	while (batch_len < batch_size && (directory = next_directory()))
+		if (!(batch[batch_len++] = strdup(directory)))
+			err(1, "strdup");
+
+	if (!batch_len || (batch_len < batch_size && num_jobs &&
+	    more_directories()))
+		return NULL;
+
+	free(label);
+	if (batch_len == 1)
+		label = strdup(batch[0]);
+	else if (asprintf(&label, "%s..%s", batch[0],
+	    batch[batch_len-1]) == -1)
+		label = NULL;
+	if (!label)
+		err(1, "malloc");
+
+	batch_taken = true;
+	return label;
+}
+
+/*
+ * The command line for a job on the given directories: the command with
+ * an argument of {} replaced by all directories, other arguments with {}
+ * repeated for every directory, or with -n and no {}, the directories
+ * appended. Built in an arena reused for every job, so there are no
+ * allocations per job once it's large enough. Without -n or {}, that's
+ * just the command.
+ */
+static char **
+job_argv(char **dirs, size_t n)
+{
+	char **argv, *p;
+	size_t num_args = 1, len = 0, need, i, j, k = 0;
+	bool append;
+
+	append = batch_size > 1 && !substituting;
+	if (!substituting && !append)
+		return command;
+
+	/* sizes first, so the arena is grown at most once */
+	for (i = 0; command[i]; i++)
+		if (!strcmp(command[i], "{}"))
+			num_args += n;
+		else if (strstr(command[i], "{}")) {
+			num_args += n;
+			for (j = 0; j < n; j++)
+				len += replace_braces(NULL, command[i],
+				    dirs[j]) + 1;
+		} else
+			num_args++;
+	if (append)
+		num_args += n;
+
+	need = num_args * sizeof(*argv) + len;
+	if (need > arena_cap) {
+		arena_cap = MAX(need, arena_cap*2);
+		if (!(arena = realloc(arena, arena_cap)))
+			err(1, "realloc");
+	}
+
+	argv = (char **)arena;
+	p = arena + num_args * sizeof(*argv);
+
+	for (i = 0; command[i]; i++)
+		if (!strcmp(command[i], "{}"))
+			for (j = 0; j < n; j++)
+				argv[k++] = dirs[j];
+		else if (strstr(command[i], "{}"))
+			for (j = 0; j < n; j++) {
+				argv[k++] = p;
+				p += replace_braces(p, command[i], dirs[j]) + 1;
+			}
+		else
+			argv[k++] = command[i];
+	if (append)
+		for (j = 0; j < n; j++)
+			argv[k++] = dirs[j];
+	argv[k] = NULL;
+
+	return argv;
+}
+
+/* writes arg with every {} replaced to out, if not NULL, returns length */
+static size_t
+replace_braces(char *out, const char *arg, const char *directory)
+{
+	size_t dir_len, len = 0;
+	const char *brace;
+
+	dir_len = strlen(directory);
+
+	while ((brace = strstr(arg, "{}"))) {
+		if (out) {
+			memcpy(out + len, arg, (size_t)(brace - arg));
+			memcpy(out + len + (brace - arg), directory, dir_len);
+		}
+		len += (size_t)(brace - arg) + dir_len;
+		arg = brace + 2;
+	}
+
+	if (out)
+		strcpy(out + len, arg);
+	return len + strlen(arg);
+}
+
+/*
+ * Starts the command in the given directory with its output going to new
+ * pipers. Returns false, having printed a warning, if the command couldn't
+ * be spawned. The fork path reports such errors from the child instead.
+ */
+static bool
+start_job(struct job *job, const char *directory)
+{
+	int stdin_pipe[2] = { -1, -1 };
+	int stdout_pipe[2];
+	int stderr_pipe[2];
+	char **argv, *record;
+	size_t len;
+	pid_t pid;
+	int dir_fd = -1, flags;
+
+	job->node = dep_taken;
+	dep_taken = NULL;
+	job->attempt = retry_taken ? retry_taken->attempt : 1;
+	job->retrying = false;
+
+	/*
+	 * Opened here rather than looked up by the child, so one that's gone
+	 * is skipped without spawning anything. With {} or -n, the
+	 * directories are arguments instead, and ssh changes directories on
+	 * the other end.
+	 */
+	if (batch_size == 1 && !substituting && !job->host &&
+	    (dir_fd = open(directory, DIR_FLAGS)) == -1) {
+		warn("%s", directory);
+		return false;
+	}
+
+	if (stdin_broadcast)
+		make_pipe(stdin_pipe);
+	if (!results_path) {
+		make_pipe(stdout_pipe);
+		make_pipe(stderr_pipe);
+	} else if (!open_results(job, directory, &stdout_pipe[1],
+	    &stderr_pipe[1])) {
+		if (stdin_broadcast) {
+			close(stdin_pipe[0]);
+			close(stdin_pipe[1]);
+		}
+		if (dir_fd != -1)
+			close(dir_fd);
+		return false;
+	}
+
+	if (batch_size > 1)
+		argv = job_argv(batch, batch_len);
+	else
+		argv = job_argv((char **)&directory, 1);
+	if (job->host)
+		argv = host_argv(job->host,
+		    batch_size > 1 || substituting ? "." : directory, argv);
+
+	/* affinity, priorities and the cgroup can only be set from the child */
+#if defined(USE_SPAWN)
+	if (!fork_jobs)
+		pid = spawn_job(argv, dir_fd, stdin_pipe[0], stdout_pipe[1],
+		    stderr_pipe[1]);
+	else
+#endif
+		pid = fork_job(argv, dir_fd, stdin_pipe[0], stdout_pipe[1],
+		    stderr_pipe[1], (int)(job - jobs));
+
+	if (dir_fd != -1)
+		close(dir_fd);
+	if (stdin_broadcast)
+		close(stdin_pipe[0]);
+	close(stdout_pipe[1]);
+	close(stderr_pipe[1]);
+
+	if (pid == -1) {
+		warn("%s: cannot run %s", directory, argv[0]);
+		if (stdin_broadcast)
+			close(stdin_pipe[1]);
+		if (results_path) {
+			close(job->results_fd);
+			job->results_fd = -1;
+			free(job->results_name);
+		} else {
+			close(stdout_pipe[0]);
+			close(stderr_pipe[0]);
+		}
+		return false;
+	}
+
+	if (!(job->directory = strdup(directory)))
+		err(1, "strdup");
+	job->pid = pid;
+	job->start = now();
+
+	job->timed_out = false;
+	job->stopping = false;
+	job->expected = progress ? lookup_history(directory) : -1;
+	if (job_timeout_secs) {
+		job->timer.fn = job_timeout;
+		job->timer.arg = job;
+		timer_set(&job->timer, job->start + job_timeout_secs);
+	}
+
+	job->group = group_output ? new_group() : NULL;
+	job->cache = cache_dir ? cache_start(directory) : NULL;
+
+	ev_add_child(pid);
+	if (!results_path) {
+		start_piper(job, 0, stdout_pipe[0]);
+		start_piper(job, 1, stderr_pipe[0]);
+	}
+
+	if (out_format == FORMAT_JSONL) {
+		record = json_event(job->prefix, job->pipers[0].prefix_len,
+		    &len, "\"start\",\"time\":%.6f,\"pid\":%ld",
+		    job->start - json_epoch, (long)pid);
+		json_emit(job->group, record, len);
+	}
+
+	if (stdin_broadcast) {
+		if ((flags = fcntl(stdin_pipe[1], F_GETFL)) == -1 ||
+		    fcntl(stdin_pipe[1], F_SETFL, flags | O_NONBLOCK) == -1)
+			err(1, "fcntl");
+		job->stdin_fd = stdin_pipe[1];
+		job->stdin_off = 0;
+		feed_job(job);
+	}
+
+	return true;
+}
+
+/*
+ * Sets up --stdin-broadcast. Unless standard input is a regular file, it's
+ * read as it becomes available into an unlinked temporary file, from
+ * which every job is fed at its own pace. The data is moved with splice()
+ * on Linux, both into the file and from the page cache to the jobs'
+ * pipes, so it's never copied through user space.
+ */
+static void
+start_broadcast(void)
+{
+	char path[] = "/tmp/within.XXXXXX";
+	const char *tmpdir;
+	struct stat st;
+	char *tmpl;
+	off_t off;
+
+	/* a job that doesn't want all of it shouldn't take us down */
+	signal(SIGPIPE, SIG_IGN);
+
+	if (fstat(STDIN_FILENO, &st) == -1)
+		err(1, "stdin");
+
+	if (S_ISREG(st.st_mode)) {
+		bcast_fd = STDIN_FILENO;
+		if ((off = lseek(STDIN_FILENO, 0, SEEK_CUR)) == -1)
+			off = 0;
+		bcast_base = off;
+		bcast_len = st.st_size > off ? (size_t)(st.st_size - off) : 0;
+		bcast_eof = true;
+		return;
+	}
+
+	if ((tmpdir = getenv("TMPDIR")) && *tmpdir) {
+		if (asprintf(&tmpl, "%s/within.XXXXXX", tmpdir) == -1)
+			err(1, "asprintf");
+	} else
+		tmpl = path;
+	if ((bcast_fd = mkstemp(tmpl)) == -1)
+		err(1, "mkstemp");
+	unlink(tmpl);
+	if (tmpl != path)
+		free(tmpl);
+	fcntl(bcast_fd, F_SETFD, FD_CLOEXEC);
+
+	/* the likes of /dev/null can't be polled, but don't block either */
+	if (S_ISCHR(st.st_mode) && !isatty(STDIN_FILENO)) {
+		read_broadcast();
+		return;
+	}
+
+	/* like -f -, see open_input() */
+	if ((bcast_flags = fcntl(STDIN_FILENO, F_GETFL)) == -1)
+		err(1, "F_GETFL");
+	if (fcntl(STDIN_FILENO, F_SETFL, bcast_flags | O_NONBLOCK) == -1)
+		err(1, "F_SETFL");
+	atexit(restore_broadcast);
+
+	ev_add(STDIN_FILENO, EV_READ, &bcast_fd);
+	bcast_watched = true;
+}
+
+static void
+restore_broadcast(void)
+{
+	if (bcast_flags != -1)
+		fcntl(STDIN_FILENO, F_SETFL, bcast_flags);
+}
+
+/* appends what's available on stdin to the file and feeds the jobs */
+static void
+read_broadcast(void)
+{
+	static char buf[65536];
+	ssize_t nr, nw;
+	size_t done;
+	int i;
+#if defined(__linux__)
+	static bool no_splice;
+	loff_t off;
+#endif
+
+	while (1) {
+#if defined(__linux__)
+		if (!no_splice) {
+			off = (loff_t)(bcast_base + (off_t)bcast_len);
+			nr = splice(STDIN_FILENO, NULL, bcast_fd, &off, 1 << 20,
+			    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (nr == -1 && errno == EINVAL) {
+				no_splice = true;
+				continue;
+			}
+		} else
+#endif
+		if ((nr = read(STDIN_FILENO, buf, sizeof(buf))) > 0) {
+			/* at the same offset, splice() may have gone first */
+			for (done = 0; done < (size_t)nr; done += (size_t)nw)
+				if ((nw = pwrite(bcast_fd, buf + done,
+				    (size_t)nr - done, bcast_base +
+				    (off_t)(bcast_len + done))) == -1)
+					err(1, "write");
+		}
+
+		if (nr > 0)
+			bcast_len += (size_t)nr;
+		else if (nr == 0) {
+			bcast_eof = true;
+			if (bcast_watched)
+				ev_del(STDIN_FILENO, EV_READ);
+			bcast_watched = false;
+			break;
+		} else if (errno == EAGAIN)
+			break;
+		else if (errno != EINTR)
+			err(1, "stdin");
+	}
+
+	for (i = 0; i < max_jobs; i++)
+		if (jobs[i].stdin_fd != -1 && !jobs[i].stdin_watched)
+			feed_job(&jobs[i]);
+}
+
+/*
+ * Writes as much of the input as the job's pipe takes, watching it if
+ * that's not all, and closes it once the job has had everything.
+ */
+static void
+feed_job(struct job *job)
+{
+	static char buf[65536];
+	ssize_t nw;
+	off_t pos;
+	size_t len;
+#if defined(__linux__)
+	static bool no_splice;
+	loff_t off;
+#endif
+
+	while (job->stdin_off < bcast_len) {
+		len = MIN(bcast_len - job->stdin_off, 1 << 20);
+		pos = bcast_base + (off_t)job->stdin_off;
+#if defined(__linux__)
+		if (!no_splice) {
+			off = (loff_t)pos;
+			nw = splice(bcast_fd, &off, job->stdin_fd, NULL, len,
+			    SPLICE_F_NONBLOCK);
+			if (nw == -1 && errno == EINVAL) {
+				no_splice = true;
+				continue;
+			}
+		} else
+#endif
+		{
+			if ((nw = pread(bcast_fd, buf, MIN(len, sizeof(buf)),
+			    pos)) == -1)
+				err(1, "pread");
+			/* a short write has the rest read again */
+			nw = write(job->stdin_fd, buf, (size_t)nw);
+		}
+
+		if (nw > 0)
+			job->stdin_off += (size_t)nw;
+		else if (nw == 0)
+			errx(1, "input file shrunk");
+		else if (errno == EAGAIN) {
+			if (!job->stdin_watched) {
+				ev_add(job->stdin_fd, EV_WRITE, job);
+				job->stdin_watched = true;
+			}
+			return;
+		} else if (errno == EPIPE) {
+			/* it didn't want the rest */
+			stop_feed(job);
+			return;
+		} else if (errno != EINTR)
+			err(1, "write");
+	}
+
+	if (job->stdin_watched) {
+		ev_del(job->stdin_fd, EV_WRITE);
+		job->stdin_watched = false;
+	}
+	if (bcast_eof)
+		stop_feed(job);
+}
+
+/* closes the job's input, if still open */
+static void
+stop_feed(struct job *job)
+{
+	if (job->stdin_fd == -1)
+		return;
+	if (job->stdin_watched) {
+		ev_del(job->stdin_fd, EV_WRITE);
+		job->stdin_watched = false;
+	}
+	close(job->stdin_fd);
+	job->stdin_fd = -1;
+}
+
+/*
+ * Joins the jobserver of the make we were run from, if any. MAKEFLAGS has
+ * either "--jobserver-auth=fifo:PATH" (make 4.4) or the descriptors of a
+ * pipe, "--jobserver-auth=R,W" ("--jobserver-fds=" before make 4.2). make
+ * only leaves those open for rules marked '+' or that run $(MAKE).
+ *
+ * The read end is shared with make and everyone else, so on Linux we open
+ * our own description of it to make non-blocking. Elsewhere it's set
+ * non-blocking for all, which make 4.3 and later do themselves as well.
+ */
+static bool
+join_jobserver(void)
+{
+	const char *flags, *auth = NULL, *p;
+	char path[64], *fifo, *end;
+	struct stat st;
+	size_t len;
+	long rfd, wfd;
+
+	if (!(flags = getenv("MAKEFLAGS")))
+		return false;
+
+	/* the last one counts */
+	for (p = flags; (p = strstr(p, "--jobserver-")); p++)
+		if (!strncmp(p, "--jobserver-auth=", 17))
+			auth = p + 17;
+		else if (!strncmp(p, "--jobserver-fds=", 16))
+			auth = p + 16;
+	if (!auth)
+		return false;
+	len = strcspn(auth, " ");
+
+	if (!strncmp(auth, "fifo:", 5)) {
+		if (!(fifo = strndup(auth+5, len-5)))
+			err(1, "strndup");
+		js_read_fd = open(fifo, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+		if (js_read_fd == -1 ||
+		    (js_write_fd = open(fifo, O_WRONLY | O_CLOEXEC)) == -1) {
+			warn("jobserver %s", fifo);
+			if (js_read_fd != -1)
+				close(js_read_fd);
+			js_read_fd = -1;
+			free(fifo);
+			return false;
+		}
+		free(fifo);
+		return true;
+	}
+
+	rfd = strtol(auth, &end, 10);
+	if (end == auth || *end != ',')
+		return false;
+	wfd = strtol(end+1, &end, 10);
+	if (end != auth + len || rfd < 0 || wfd < 0 ||
+	    rfd > INT_MAX || wfd > INT_MAX)
+		return false;	/* make's way of saying it's off */
+
+	if (fstat((int)rfd, &st) == -1 || !S_ISFIFO(st.st_mode) ||
+	    fcntl((int)wfd, F_GETFD) == -1) {
+		warnx("jobserver unavailable, add '+' to the make rule");
+		return false;
+	}
+
+	js_write_fd = (int)wfd;
+
+#if defined(__linux__)
+	snprintf(path, sizeof(path), "/proc/self/fd/%ld", rfd);
+	js_read_fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (js_read_fd != -1)
+		return true;
+#else
+	(void)path;
+#endif
+
+	js_read_fd = (int)rfd;
+	if ((js_flags = fcntl(js_read_fd, F_GETFL)) == -1)
+		err(1, "F_GETFL");
+	if (fcntl(js_read_fd, F_SETFL, js_flags | O_NONBLOCK) == -1)
+		err(1, "F_SETFL");
+	atexit(restore_jobserver);
+
+	return true;
+}
+
+/*
+ * --jobserver: makes a jobserver of our own with room for the given number
+ * of jobs in all, ours and those of the makes we run, and puts it in
+ * MAKEFLAGS for them. It's a FIFO rather than a pipe so that we can have a
+ * non-blocking description of the read end while the children inherit a
+ * blocking one, which older makes need. It's unlinked right away.
+ *
+ * Any -j in MAKEFLAGS is replaced; a -j on a nested make's command line
+ * makes it leave the jobserver.
+ */
+static void
+start_jobserver(int tokens)
+{
+	char tmpl_buf[] = "/tmp/within.XXXXXX";
+	const char *tmpdir, *old, *word;
+	char *tmpl, *path, *flags, *p;
+	size_t len, cap;
+	int child_rfd, i;
+
+	if ((tmpdir = getenv("TMPDIR")) && *tmpdir) {
+		if (asprintf(&tmpl, "%s/within.XXXXXX", tmpdir) == -1)
+			err(1, "asprintf");
+	} else if (!(tmpl = strdup(tmpl_buf)))
+		err(1, "strdup");
+	if (!mkdtemp(tmpl))
+		err(1, "mkdtemp");
+	if (asprintf(&path, "%s/jobserver", tmpl) == -1)
+		err(1, "asprintf");
+	if (mkfifo(path, 0600) == -1)
+		err(1, "mkfifo");
+
+	/* with a reader and then a writer, neither open blocks */
+	if ((js_read_fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC)) == -1)
+		err(1, "%s", path);
+	if ((js_write_fd = open(path, O_WRONLY)) == -1)
+		err(1, "%s", path);
+	if ((child_rfd = open(path, O_RDONLY)) == -1)
+		err(1, "%s", path);
+
+	unlink(path);
+	rmdir(tmpl);
+	free(path);
+	free(tmpl);
+
+	/* one less, the first job's is free; at most PIPE_BUF fit */
+	for (i = 1; i < tokens; i++)
+		if (write(js_write_fd, "+", 1) != 1)
+			err(1, "jobserver");
+
+	old = getenv("MAKEFLAGS");
+	cap = (old ? strlen(old) : 0) + 64;
+	if (!(flags = malloc(cap)))
+		err(1, "malloc");
+	p = flags;
+
+	/* keep the other flags, like -k or -s */
+	for (word = old; word && *word; word += len) {
+		word += strspn(word, " ");
+		len = strcspn(word, " ");
+		if (!len || !strncmp(word, "-j", 2) ||
+		    !strncmp(word, "--jobserver-", 12))
+			continue;
+		memcpy(p, word, len);
+		p += len;
+		*p++ = ' ';
+	}
+
+	snprintf(p, cap - (size_t)(p - flags), "-j%d --jobserver-auth=%d,%d",
+	    tokens, child_rfd, js_write_fd);
+	if (setenv("MAKEFLAGS", flags, 1) == -1)
+		err(1, "setenv");
+	free(flags);
+}
+
+static void
+restore_jobserver(void)
+{
+	fcntl(js_read_fd, F_SETFL, js_flags);
+}
+
+/*
+ * Gets the job a jobserver token, true if it did or needn't. The first
+ * local job goes for free; the others wait for a byte from the pipe. Jobs
+ * on other hosts don't count.
+ */
+static bool
+take_token(struct job *job)
+{
+	unsigned char c;
+	ssize_t nread;
+
+	if (js_read_fd == -1 || job->host)
+		return true;
+
+	if (!js_free_taken) {
+		js_free_taken = true;
+		job->token = TOKEN_FREE;
+		return true;
+	}
+
+	while ((nread = read(js_read_fd, &c, 1)) == -1 && errno == EINTR)
+		;
+	if (nread == 1) {
+		job->token = c;
+		return true;
+	}
+	if (nread == -1 && errno != EAGAIN)
+		err(1, "jobserver");
+	if (!nread) {
+		/* make is gone, don't spin on it */
+		warnx("jobserver closed, no longer using it");
+		close(js_read_fd);
+		js_read_fd = -1;
+		return true;
+	}
+
+	if (!js_watched) {
+		ev_add(js_read_fd, EV_READ, &js_read_fd);
+		js_watched = true;
+	}
+	return false;
+}
+
+/* returns the job's token, if it has any */
+static void
+give_token(struct job *job)
+{
+	unsigned char c;
+	ssize_t nw;
+
+	if (job->token == TOKEN_NONE)
+		return;
+	if (job->token == TOKEN_FREE)
+		js_free_taken = false;
+	else {
+		/* make 4.4 wants its own byte back */
+		c = (unsigned char)job->token;
+		while ((nw = write(js_write_fd, &c, 1)) == -1 &&
+		    errno == EINTR)
+			;
+		if (nw != 1)
+			warn("jobserver");
+	}
+	job->token = TOKEN_NONE;
+}
+
+/* returns a slot that's not taken, or NULL if there's none */
+static struct job *
+free_slot(void)
+{
+	struct job *job;
+
+	for (job = jobs; job < jobs + max_jobs; job++)
+		if (!job->pid &&
+		    job->pipers[0].in_fd == -1 &&
+		    !job->pipers[0].pending.queued &&
+		    job->pipers[1].in_fd == -1 &&
+		    !job->pipers[1].pending.queued)
+			return job;
+
+	return NULL;
+}
+
+static struct job *
+find_job(pid_t pid)
+{
+	int i;
+
+	for (i = 0; i < max_jobs; i++)
+		if (jobs[i].pid == pid)
+			return &jobs[i];
+
+	return NULL;
+}
+
+/* frees the slot, recording the job's resource usage for --stats */
+static void
+finish_job(struct job *job, int status, const struct rusage *usage)
+{
+	struct job_stats *rec;
+	double wall;
+
+	wall = now() - job->start;
+	timer_cancel(&job->timer);
+	stop_feed(job);
+	give_token(job);
+
+	if (out_format == FORMAT_JSONL)
+		json_exit(job, status);
+
+	/* the attempt's output, if held back, and results don't count */
+	if (job->retrying) {
+		if (job->group)
+			job->group->discard = true;
+		if (job->results_fd != -1) {
+			close(job->results_fd);
+			job->results_fd = -1;
+			free(job->results_name);
+		}
+	} else {
+		num_done++;
+		done_wall += wall;
+	}
+
+	if (job->results_fd != -1)
+		finish_results(job, status, wall);
+	if (job->node) {
+		finish_dep(job->node, !status && !job->timed_out);
+		job->node = NULL;
+	}
+
+	if (job->group)
+		release_group(job->group);
+	if (job->cache) {
+		job->cache->ok = !status && !job->timed_out;
+		cache_release(job->cache);
+	}
+
+	/* a batch's isn't any one directory's */
+	if (history_path && batch_size == 1 && !job->retrying)
+		set_history(job->directory, wall);
+
+	if (stats_format == STATS_NONE || job->retrying) {
+		free(job->directory);
+		job->pid = 0;
+		return;
+	}
+
+	if (num_stats == stats_cap) {
+		stats_cap = stats_cap ? stats_cap*2 : 64;
+		if (!(stats = realloc(stats, stats_cap * sizeof(*stats))))
+			err(1, "realloc");
+	}
+
+	rec = &stats[num_stats++];
+	rec->directory = job->directory;
+	rec->status = status;
+	rec->timed_out = job->timed_out;
+	rec->wall = wall;
+	rec->user = usage->ru_utime.tv_sec + usage->ru_utime.tv_usec / 1e6;
+	rec->sys = usage->ru_stime.tv_sec + usage->ru_stime.tv_usec / 1e6;
+#if defined(__APPLE__)
+	rec->maxrss = usage->ru_maxrss / 1024;	/* bytes on macOS */
+#else
+	rec->maxrss = usage->ru_maxrss;
+#endif
+
+	job->pid = 0;
+}
+
+/*
+ * Prints either the slowest and most CPU hungry jobs, with totals, or all
+ * jobs as TSV ordered by wall time. Goes to stderr, after all other output.
+ */
+static void
+print_stats(void)
+{
+	double user = 0, sys = 0;
+	char status[16];
+	size_t i, j, n, num_timed_out = 0;
+	int pass;
+
+	qsort(stats, num_stats, sizeof(*stats), cmp_wall);
+
+	if (stats_format == STATS_TSV) {
+		fprintf(stderr, "directory\tstatus\twall\tuser\tsys\t"
+		    "maxrss\n");
+		for (i = 0; i < num_stats; i++) {
+			format_status(status, sizeof(status), stats[i].status,
+			    stats[i].timed_out);
+			tsv_field(stderr, stats[i].directory);
+			fprintf(stderr, "\t%s\t%.3f\t%.3f\t%.3f\t%ld\n",
+			    status, stats[i].wall, stats[i].user,
+			    stats[i].sys, stats[i].maxrss);
+		}
+		return;
+	}
+
+	for (i = 0; i < num_stats; i++) {
+		user += stats[i].user;
+		sys += stats[i].sys;
+		num_timed_out += stats[i].timed_out;
+	}
+
+	fprintf(stderr, "\nwithin: %zu jobs, %.2fs user, %.2fs sys",
+	    num_stats, user, sys);
+	if (num_timed_out)
+		fprintf(stderr, ", %zu timed out", num_timed_out);
+	if (num_cached)
+		fprintf(stderr, ", %zu cached", num_cached);
+	fputc('\n', stderr);
+
+	n = MIN(num_stats, 10);
+
+	for (pass = 0; pass < 2 && n; pass++) {
+		if (pass)
+			qsort(stats, num_stats, sizeof(*stats), cmp_cpu);
+
+		fprintf(stderr, "\n%s:\n%9s %9s %9s %9s %7s  %s\n",
+		    pass ? "most CPU time" : "slowest",
+		    "wall", "user", "sys", "max rss", "status", "directory");
+
+		for (j = 0; j < n; j++) {
+			format_status(status, sizeof(status), stats[j].status,
+			    stats[j].timed_out);
+
+			fprintf(stderr, "%8.2fs %8.2fs %8.2fs %7ldMB %7s  %s\n",
+			    stats[j].wall, stats[j].user, stats[j].sys,
+			    stats[j].maxrss / 1024, status,
+			    stats[j].directory);
+		}
+	}
+}
+
+/* the exit status as --stats and --results show it */
+static void
+format_status(char *buf, size_t size, int status, bool timed_out)
+{
+	if (timed_out)
+		snprintf(buf, size, "timeout");
+	else
+		snprintf(buf, size, "%d", WIFEXITED(status) ?
+		    WEXITSTATUS(status) : 128 + WTERMSIG(status));
+}
+
+/*
+ * --results writes the output of every job straight to files in a
+ * directory of its own, DIR/<name>/stdout and stderr, which are the job's
+ * descriptors so none of it passes through us. exitcode is written when
+ * the job is done and index.tsv lists all jobs as they finish.
+ */
+static void
+start_results(void)
+{
+	int fd;
+
+	if (mkdir(results_path, 0777) == -1 && errno != EEXIST)
+		err(1, "%s", results_path);
+	if ((results_fd = open(results_path, O_RDONLY | O_DIRECTORY |
+	    O_CLOEXEC)) == -1)
+		err(1, "%s", results_path);
+
+	if ((fd = openat(results_fd, "index.tsv", O_WRONLY | O_CREAT |
+	    O_TRUNC | O_CLOEXEC, 0666)) == -1 ||
+	    !(results_index = fdopen(fd, "w")))
+		err(1, "%s/index.tsv", results_path);
+	setvbuf(results_index, NULL, _IOLBF, 0);
+	fprintf(results_index, "directory\tstatus\twall\tresults\n");
+}
+
+/* creates the job's results directory and files, false on error */
+static bool
+open_results(struct job *job, const char *directory, int *out_fd,
+    int *err_fd)
+{
+	char *name;
+	int fd;
+
+	name = results_name(directory);
+
+	if (mkdirat(results_fd, name, 0777) == -1 && errno != EEXIST) {
+		warn("%s/%s", results_path, name);
+		free(name);
+		return false;
+	}
+	if ((fd = openat(results_fd, name, O_RDONLY | O_DIRECTORY |
+	    O_CLOEXEC)) == -1) {
+		warn("%s/%s", results_path, name);
+		free(name);
+		return false;
+	}
+
+	/* from an earlier run */
+	unlinkat(fd, "exitcode", 0);
+
+	*out_fd = openat(fd, "stdout", O_WRONLY | O_CREAT | O_TRUNC |
+	    O_CLOEXEC, 0666);
+	*err_fd = *out_fd == -1 ? -1 : openat(fd, "stderr", O_WRONLY |
+	    O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (*err_fd == -1) {
+		warn("%s/%s", results_path, name);
+		if (*out_fd != -1)
+			close(*out_fd);
+		close(fd);
+		free(name);
+		return false;
+	}
+
+	job->results_fd = fd;
+	job->results_name = name;
+	return true;
+}
+
+static void
+finish_results(struct job *job, int status, double wall)
+{
+	char buf[16];
+	int fd;
+
+	format_status(buf, sizeof(buf), status, job->timed_out);
+
+	if ((fd = openat(job->results_fd, "exitcode", O_WRONLY | O_CREAT |
+	    O_TRUNC | O_CLOEXEC, 0666)) == -1 ||
+	    dprintf(fd, "%s\n", buf) < 0)
+		warn("%s/%s/exitcode", results_path, job->results_name);
+	if (fd != -1)
+		close(fd);
+
+	tsv_field(results_index, job->directory);
+	fprintf(results_index, "\t%s\t%.3f\t%s\n", buf, wall,
+	    job->results_name);
+
+	close(job->results_fd);
+	job->results_fd = -1;
+	free(job->results_name);
+}
+
+/* lists a job that couldn't be started, with - for what it didn't get */
+static void
+fail_results(const char *directory)
+{
+	tsv_field(results_index, directory);
+	fputs("\t-\t-\t-\n", results_index);
+}
+
+/*
+ * The directory as a single file name: '%', '/' and control characters
+ * become %XX, as does a leading '.' so that "." and ".." work. Trailing
+ * slashes are dropped, as is index.tsv's name. Names over NAME_MAX are
+ * cut short and end in '~' and the hash of the directory. To be freed.
+ */
+static char *
+results_name(const char *directory)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	unsigned char c;
+	size_t len, i;
+	char *name, *p;
+
+	for (len = strlen(directory); len > 1 && directory[len-1] == '/';
+	    len--)
+		;
+
+	if (!(name = malloc(len*3 + 1)))
+		err(1, "malloc");
+
+	for (i = 0, p = name; i < len; i++) {
+		c = (unsigned char)directory[i];
+		if (c == '%' || c == '/' || c < 0x20 || c == 0x7f ||
+		    (!i && c == '.') ||
+		    (!i && len == 9 && !strncmp(directory, "index.tsv", 9))) {
+			*p++ = '%';
+			*p++ = hex[c >> 4];
+			*p++ = hex[c & 15];
+		} else
+			*p++ = (char)c;
+	}
+	*p = '\0';
+
+	if ((size_t)(p - name) > NAME_MAX) {
+		/* not in the middle of a %XX */
+		p = name + NAME_MAX - 17;
+		if (p[-1] == '%')
+			p--;
+		else if (p[-2] == '%')
+			p -= 2;
+		sprintf(p, "~%016llx", hash_string(directory, FNV_INIT));
+	}
+
+	return name;
+}
+
+/* a TSV field, with tabs, newlines and backslashes as \t, \n and \\ */
+static void
+tsv_field(FILE *f, const char *s)
+{
+	for (; *s; s++)
+		if (*s == '\t')
+			fputs("\\t", f);
+		else if (*s == '\n')
+			fputs("\\n", f);
+		else if (*s == '\\')
+			fputs("\\\\", f);
+		else
+			putc(*s, f);
+}
+
+/* orders struct job_stats by wall time, descending */
+static int
+cmp_wall(const void *a, const void *b)
+{
+	const struct job_stats *sa = a, *sb = b;
+
+	return (sa->wall < sb->wall) - (sa->wall > sb->wall);
+}
+
+/* orders struct job_stats by user+system time, descending */
+static int
+cmp_cpu(const void *a, const void *b)
+{
+	const struct job_stats *sa = a, *sb = b;
+	double ca = sa->user + sa->sys;
+	double cb = sb->user + sb->sys;
+
+	return (ca < cb) - (ca > cb);
+}
+
+/* monotonic time in seconds */
+static double
+now(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		err(1, "clock_gettime");
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Sets a timer for when, moving it if already set. Timers are kept in a
+ * binary heap by time so the soonest is always at the top, for
+ * timer_timeout().
+ */
+static void
+timer_set(struct timer *timer, double when)
+{
+	if (timer->pos) {
+		timer->when = when;
+		timer_up(timer->pos - 1);
+		timer_down(timer->pos - 1);
+		return;
+	}
+
+	if (num_timers == timers_cap) {
+		timers_cap = timers_cap ? timers_cap*2 : 64;
+		if (!(timers = realloc(timers, timers_cap * sizeof(*timers))))
+			err(1, "realloc");
+	}
+
+	timer->when = when;
+	timer->pos = num_timers + 1;
+	timers[num_timers++] = timer;
+	timer_up(num_timers - 1);
+}
+
+static void
+timer_cancel(struct timer *timer)
+{
+	size_t i;
+
+	if (!timer->pos)
+		return;
+
+	i = timer->pos - 1;
+	timer->pos = 0;
+
+	/* move the last one into the hole */
+	if (i != --num_timers) {
+		timers[i] = timers[num_timers];
+		timers[i]->pos = i + 1;
+		timer_up(i);
+		timer_down(i);
+	}
+}
+
+static void
+timer_swap(size_t a, size_t b)
+{
+	struct timer *tmp;
+
+	tmp = timers[a];
+	timers[a] = timers[b];
+	timers[b] = tmp;
+	timers[a]->pos = a + 1;
+	timers[b]->pos = b + 1;
+}
+
+static void
+timer_up(size_t i)
+{
+	while (i && timers[i]->when < timers[(i-1)/2]->when) {
+		timer_swap(i, (i-1)/2);
+		i = (i-1)/2;
+	}
+}
+
+static void
+timer_down(size_t i)
+{
+	size_t min;
+
+	while (1) {
+		min = i;
+		if (i*2+1 < num_timers &&
+		    timers[i*2+1]->when < timers[min]->when)
+			min = i*2+1;
+		if (i*2+2 < num_timers &&
+		    timers[i*2+2]->when < timers[min]->when)
+			min = i*2+2;
+		if (min == i)
+			break;
+		timer_swap(i, min);
+		i = min;
+	}
+}
+
+/* milliseconds until the first timer, rounded up, or -1 if there's none */
+static int
+timer_timeout(void)
+{
+	double ms;
+
+	if (!num_timers)
+		return -1;
+
+	ms = (timers[0]->when - now()) * 1000;
+	return ms <= 0 ? 0 : ms >= INT_MAX ? INT_MAX : (int)ms + 1;
+}
+
+/* fires and removes expired timers */
+static void
+run_timers(void)
+{
+	struct timer *timer;
+	double t;
+
+	t = now();
+
+	while (num_timers && (timer = timers[0])->when <= t) {
+		timer_cancel(timer);
+		if (timer->fn)
+			timer->fn(timer->arg);
+	}
+}
+
+static void
+job_timeout(void *arg)
+{
+	struct job *job = arg;
+
+	warnx("%s: timed out", job->directory);
+	job->timed_out = true;
+	stop_job(job);
+}
+
+/*
+ * Queues another go at a failed job's directory after --retry-delay,
+ * doubled for every attempt before. Returns false if it's out of tries.
+ */
+static bool
+retry_job(struct job *job)
+{
+	struct retry *retry;
+	double delay;
+	char buf[32];
+	int i;
+
+	if (job->attempt > max_retries || halting || got_signal)
+		return false;
+
+	if (!(retry = calloc(1, sizeof(*retry))))
+		err(1, "calloc");
+	if (!(retry->directory = strdup(job->directory)))
+		err(1, "strdup");
+	retry->attempt = job->attempt + 1;
+	retry->node = job->node;
+	job->node = NULL;
+
+	for (delay = retry_delay, i = 1; i < job->attempt; i++)
+		delay *= 2;
+
+	retry->timer.fn = retry_due;
+	retry->timer.arg = retry;
+	timer_set(&retry->timer, now() + delay);
+	retries_waiting++;
+
+	format_secs(buf, sizeof(buf), delay);
+	warnx("%s: failed, retrying in %s", job->directory, buf);
+	job->retrying = true;
+	return true;
+}
+
+static void
+retry_due(void *arg)
+{
+	struct retry *retry = arg;
+
+	retries_waiting--;
+	*retry_ready_tail = retry;
+	retry_ready_tail = &retry->next;
+}
+
+/* sends SIGTERM and, if it's still there after --kill-after, SIGKILL */
+static void
+stop_job(struct job *job)
+{
+	if (job->stopping)
+		return;
+	job->stopping = true;
+
+	if (!kill_after) {
+		signal_job(job, SIGKILL);
+		return;
+	}
+
+	signal_job(job, SIGTERM);
+	job->timer.fn = kill_job;
+	job->timer.arg = job;
+	timer_set(&job->timer, now() + kill_after);
+}
+
+static void
+kill_job(void *arg)
+{
+	signal_job(arg, SIGKILL);
+}
+
+/* to the job's process group if it has one, so its children get it too */
+static void
+signal_job(struct job *job, int sig)
+{
+	kill(use_pgroups ? -job->pid : job->pid, sig);
+}
+
+/* --halt now|soon[,fail=N[%]] */
+static void
+parse_halt(const char *arg)
+{
+	const char *rest;
+	char *end;
+
+	if (!strncmp(arg, "now", 3)) {
+		halt_when = HALT_NOW;
+		rest = arg + 3;
+	} else if (!strncmp(arg, "soon", 4)) {
+		halt_when = HALT_SOON;
+		rest = arg + 4;
+	} else if (!strcmp(arg, "never")) {
+		halt_when = HALT_NEVER;
+		return;
+	} else
+		errx(1, "invalid --halt: %s", arg);
+
+	if (!*rest)
+		return;
+	if (strncmp(rest, ",fail=", 6))
+		errx(1, "invalid --halt: %s", arg);
+
+	rest += 6;
+	errno = 0;
+	halt_fail = (size_t)strtoul(rest, &end, 10);
+	if (errno || end == rest || !halt_fail)
+		errx(1, "invalid --halt: %s", arg);
+	if ((halt_percent = *end == '%'))
+		end++;
+	if (*end || (halt_percent && halt_fail > 100))
+		errx(1, "invalid --halt: %s", arg);
+}
+
+/*
+ * Starts halting once enough jobs have failed. A percentage is of all
+ * directories seen so far, which with -f or --find-marker may not be all.
+ */
+static void
+check_halt(void)
+{
+	size_t total;
+	int i;
+
+	if (halt_when == HALT_NEVER || halting)
+		return;
+
+	if (halt_percent) {
+		total = num_started + num_pending + !!job_held;
+		if (next_arg < num_directories)
+			total += (size_t)(num_directories - next_arg);
+		if (num_failed * 100 < halt_fail * total)
+			return;
+	} else if (num_failed < halt_fail)
+		return;
+
+	halting = true;
+
+	if (halt_when == HALT_SOON) {
+		warnx("%zu failed, waiting for running jobs", num_failed);
+		return;
+	}
+
+	warnx("%zu failed, stopping running jobs", num_failed);
+	for (i = 0; i < max_jobs; i++)
+		if (jobs[i].pid)
+			stop_job(&jobs[i]);
+}
+
+/*
+ * With jobs in their own process groups, signals from the terminal only
+ * reach us, so pass those on. We then stop starting jobs and wait for the
+ * rest, to exit with the signal at the end.
+ */
+static void
+init_forwarding(void)
+{
+	static const int sigs[] = { SIGINT, SIGTERM, SIGHUP };
+	struct sigaction sa;
+	size_t i;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sig_forward;
+	sigemptyset(&sa.sa_mask);
+
+	for (i = 0; i < LEN(sigs); i++)
+		if (sigaction(sigs[i], &sa, NULL) == -1)
+			err(1, "sigaction");
+}
+
+/* the jobs' exits will wake up the event loop */
+static void
+sig_forward(int sig)
+{
+	int saved_errno = errno;
+	int i;
+
+	got_signal = sig;
+
+	for (i = 0; i < max_jobs; i++)
+		if (jobs[i].pid > 0)
+			kill(-jobs[i].pid, sig);
+
+	errno = saved_errno;
+}
+
+/*
+ * --progress keeps a status line at the bottom of the terminal, redrawn
+ * from a timer rather than as output comes in. Output to the terminal
+ * clears it first and it's back by the next redraw, once the sinks have
+ * nothing queued.
+ */
+static void
+start_progress(void)
+{
+	double sum;
+	size_t i;
+
+	for (i = 0; i < LEN(sinks); i++)
+		sinks[i].tty = isatty(sinks[i].fd);
+
+	if (num_history) {
+		for (i = 0, sum = 0; i < history_cap; i++)
+			if (history[i].directory)
+				sum += history[i].secs;
+		history_mean = sum / (double)num_history;
+	}
+
+	progress_start = now();
+	progress_timer.fn = draw_progress;
+	timer_set(&progress_timer, progress_start + PROGRESS_INTERVAL);
+}
+
+/*
+ * Shows what's done, running, failed and left, the rate and, when the
+ * number left is known, an ETA: the jobs left at the mean duration so far
+ * (or from --history before any finished) plus what the running ones have
+ * still to go, spread over the job slots.
+ */
+static void
+draw_progress(void *arg)
+{
+	char line[512], eta[32];
+	struct winsize ws;
+	struct job *job;
+	size_t done, left, running = 0, len;
+	double t, mean, work;
+	bool known;
+	int n;
+
+	(void)arg;
+
+	t = now();
+	timer_set(&progress_timer, t + PROGRESS_INTERVAL);
+
+	/* don't come between output and the rest of its line */
+	if (sinks[0].head || sinks[1].head || sinks[0].midline ||
+	    sinks[1].midline)
+		return;
+
+	for (job = jobs; job < jobs + max_jobs; job++)
+		running += job->pid > 0;
+	done = num_done + num_cached;
+	left = jobs_left(&known);
+
+	n = snprintf(line, sizeof(line), "\rwithin: %zu", done);
+	if (known)
+		n += snprintf(line+n, sizeof(line)-(size_t)n, "/%zu",
+		    done + running + left);
+	n += snprintf(line+n, sizeof(line)-(size_t)n, " done, %zu running",
+	    running);
+	if (num_failed)
+		n += snprintf(line+n, sizeof(line)-(size_t)n, ", %zu failed",
+		    num_failed);
+	if (t > progress_start)
+		n += snprintf(line+n, sizeof(line)-(size_t)n, ", %.1f/s",
+		    (double)done / (t - progress_start));
+
+	mean = num_done ? done_wall / (double)num_done : history_mean;
+	if (known && mean >= 0) {
+		work = (double)left * mean;
+		for (job = jobs; job < jobs + max_jobs; job++)
+			if (job->pid > 0)
+				work += MAX((job->expected >= 0 ?
+				    job->expected : mean) - (t - job->start),
+				    0);
+		format_secs(eta, sizeof(eta), work / max_jobs);
+		n += snprintf(line+n, sizeof(line)-(size_t)n, ", ETA %s",
+		    eta);
+	}
+
+	/* a wrapped line can't be cleared with a \r */
+	len = MIN((size_t)n, sizeof(line)-4);
+	if (ioctl(STDERR_FILENO, TIOCGWINSZ, &ws) != -1 && ws.ws_col &&
+	    len > ws.ws_col)
+		len = ws.ws_col;	/* the \r takes no room */
+	memcpy(line+len, "\033[K", 3);
+
+	if (write(STDERR_FILENO, line, len+3) > 0)
+		progress_shown = true;
+}
+
+static void
+clear_progress(void)
+{
+	ssize_t nw;
+
+	nw = write(STDERR_FILENO, "\r\033[K", 4);
+	(void)nw;
+	progress_shown = false;
+}
+
+/*
+ * Jobs that have yet to be started. Sets known to false if there may be
+ * more directories to come from -f or --find-marker.
+ */
+static size_t
+jobs_left(bool *known)
+{
+	struct retry *retry;
+	size_t n, more;
+	const char *p, *end;
+
+	/* ones that were taken already, but will still run */
+	more = retries_waiting + !!job_held;
+	for (retry = retry_ready; retry; retry = retry->next)
+		more++;
+
+	*known = true;
+	if (deps_path)
+		return deps_left + more;
+
+	n = (size_t)(num_directories - next_arg) + num_pending +
+	    cache_checking;
+
+	if (input_fd != -1) {
+		*known = input_eof;
+		end = input_buf + input_len;
+		for (p = input_buf + input_off; p < end; p++) {
+			if (!(p = memchr(p, input_delim, (size_t)(end-p))))
+				break;
+			n++;
+		}
+		if (input_eof && input_off < input_len &&
+		    end[-1] != input_delim)
+			n++;
+	}
+
+	return (n + batch_size-1) / batch_size + more;
+}
+
+/* like 4.5s, 12m05s or 3h20m */
+static void
+format_secs(char *buf, size_t size, double secs)
+{
+	long s = (long)(secs + 0.5);
+
+	if (secs < 59.95)
+		snprintf(buf, size, "%.1fs", secs);
+	else if (s < 3600)
+		snprintf(buf, size, "%ldm%02lds", s/60, s%60);
+	else
+		snprintf(buf, size, "%ldh%02ldm", s/3600, s/60%60);
+}
+
+/* SIGUSR1, or SIGINFO (^T) where there's one, lists the running jobs */
+static void
+init_info(void)
+{
+	struct sigaction sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sig_info;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+
+	if (sigaction(SIGUSR1, &sa, NULL) == -1)
+		err(1, "sigaction");
+#if defined(SIGINFO)
+	if (sigaction(SIGINFO, &sa, NULL) == -1)
+		err(1, "sigaction");
+#endif
+}
+
+static void
+sig_info(int sig)
+{
+	int saved_errno = errno;
+#if !defined(USE_KQUEUE)
+	ssize_t nw;
+#endif
+
+	(void)sig;
+	got_info = 1;
+
+	/* wake up the event loop, with a spurious EV_CHILD */
+#if !defined(USE_KQUEUE)
+	nw = write(ev_sigpipe[1], "", 1);
+	(void)nw;
+#endif
+	errno = saved_errno;
+}
+
+/* to standard error, longest running first */
+static void
+print_running(void)
+{
+	struct job **running;
+	char line[PATH_MAX + 64], secs[32];
+	struct iovec iov;
+	size_t n = 0, i;
+	double t;
+	int len;
+
+	if (!(running = calloc((size_t)max_jobs, sizeof(*running))))
+		err(1, "calloc");
+	for (i = 0; i < (size_t)max_jobs; i++)
+		if (jobs[i].pid > 0)
+			running[n++] = &jobs[i];
+	qsort(running, n, sizeof(*running), cmp_start);
+
+	if (progress_shown)
+		clear_progress();
+
+	t = now();
+	len = snprintf(line, sizeof(line), "within: %zu running, %zu done, "
+	    "%zu failed\n", n, num_done + num_cached, num_failed);
+	iov.iov_base = line;
+	iov.iov_len = (size_t)len;
+	write_all(STDERR_FILENO, &iov, 1);
+
+	for (i = 0; i < n; i++) {
+		format_secs(secs, sizeof(secs), t - running[i]->start);
+		len = snprintf(line, sizeof(line), "%8s  %s%s%s\n", secs,
+		    running[i]->host ? running[i]->host->name : "",
+		    running[i]->host ? ":" : "", running[i]->directory);
+		iov.iov_base = line;
+		iov.iov_len = MIN((size_t)len, sizeof(line)-1);
+		write_all(STDERR_FILENO, &iov, 1);
+	}
+
+	free(running);
+}
+
+static int
+cmp_start(const void *a, const void *b)
+{
+	const struct job *ja = *(struct job * const *)a;
+	const struct job *jb = *(struct job * const *)b;
+
+	return ja->start < jb->start ? -1 : ja->start > jb->start;
+}
+
+/*
+ * --hosts is a list of [jobs/]host, ':' meaning this machine, with -j as
+ * the default number of jobs. The job slots are divided between them.
+ */
+static void
+parse_hosts(const char *arg)
+{
+	struct host *host;
+	char *list, *item, *slash, *end;
+	int default_jobs = max_jobs;
+
+	if (!(list = strdup(arg)))
+		err(1, "strdup");
+
+	max_jobs = 0;
+
+	for (item = strtok(list, ","); item; item = strtok(NULL, ",")) {
+		if (!(hosts = realloc(hosts, (size_t)(num_hosts+1) *
+		    sizeof(*hosts))))
+			err(1, "realloc");
+		host = &hosts[num_hosts++];
+		memset(host, 0, sizeof(*host));
+		host->jobs = default_jobs;
+
+		if ((slash = strchr(item, '/'))) {
+			host->jobs = (int)strtol(item, &end, 10);
+			if (end != slash || host->jobs < 1)
+				errx(1, "invalid --hosts: %s", arg);
+			item = slash+1;
+		}
+
+		if (!*item)
+			errx(1, "invalid --hosts: %s", arg);
+		if (strcmp(item, ":") && !(host->name = strdup(item)))
+			err(1, "strdup");
+
+		max_jobs += host->jobs;
+	}
+
+	if (!num_hosts)
+		errx(1, "invalid --hosts: %s", arg);
+
+	free(list);
+}
+
+/*
+ * Opens a master connection to every remote host, all at once, with
+ * their ControlPaths in a private directory. Jobs then only open a
+ * channel on it. ssh -f returns once the master is ready. Hosts that
+ * can't be reached are dropped with a warning.
+ *
+ * Jobs pull from the same queue whichever host their slot is on, so a
+ * faster host simply takes more.
+ */
+static void
+start_hosts(void)
+{
+	char path[] = "/tmp/within.XXXXXX";
+	const char *tmpdir;
+	char *tmpl;
+	char *argv[12];
+	pid_t *pids;
+	int i, status;
+
+	if ((tmpdir = getenv("TMPDIR")) && *tmpdir) {
+		if (asprintf(&tmpl, "%s/within.XXXXXX", tmpdir) == -1)
+			err(1, "asprintf");
+	} else if (!(tmpl = strdup(path)))
+		err(1, "strdup");
+	if (!(host_dir = mkdtemp(tmpl)))
+		err(1, "mkdtemp");
+
+	if (!(pids = calloc((size_t)num_hosts, sizeof(*pids))))
+		err(1, "calloc");
+
+	for (i = 0; i < num_hosts; i++) {
+		if (!hosts[i].name)
+			continue;
+		if (asprintf(&hosts[i].control, "%s/%d", host_dir, i) == -1)
+			err(1, "asprintf");
+
+		argv[0] = "ssh";
+		argv[1] = "-f";
+		argv[2] = "-N";
+		argv[3] = "-o";
+		argv[4] = "ControlMaster=yes";
+		argv[5] = "-o";
+		argv[6] = "ControlPersist=60";	/* idle, should we crash */
+		argv[7] = "-S";
+		argv[8] = hosts[i].control;
+		argv[9] = "--";
+		argv[10] = hosts[i].name;
+		argv[11] = NULL;
+		pids[i] = run_ssh(argv, false);
+	}
+
+	for (i = 0; i < num_hosts; i++) {
+		if (!pids[i])
+			continue;
+		while (waitpid(pids[i], &status, 0) == -1)
+			if (errno != EINTR)
+				err(1, "waitpid");
+		if (status) {
+			warnx("%s: cannot connect, not using it",
+			    hosts[i].name);
+			max_jobs -= hosts[i].jobs;
+			hosts[i].jobs = 0;
+		} else
+			hosts[i].connected = true;
+	}
+
+	free(pids);
+
+	atexit(stop_hosts);
+
+	if (!max_jobs)
+		errx(1, "no hosts left");
+}
+
+/* closes the master connections, called at exit */
+static void
+stop_hosts(void)
+{
+	char *argv[8];
+	pid_t pid;
+	int i;
+
+	for (i = 0; i < num_hosts; i++) {
+		if (!hosts[i].connected)
+			continue;
+		hosts[i].connected = false;
+
+		argv[0] = "ssh";
+		argv[1] = "-S";
+		argv[2] = hosts[i].control;
+		argv[3] = "-O";
+		argv[4] = "exit";
+		argv[5] = "--";
+		argv[6] = hosts[i].name;
+		argv[7] = NULL;
+		if ((pid = run_ssh(argv, true)) > 0)
+			while (waitpid(pid, NULL, 0) == -1 && errno == EINTR)
+				;
+	}
+
+	if (host_dir) {
+		rmdir(host_dir);
+		host_dir = NULL;
+	}
+}
+
+/* starts ssh for start_hosts() or stop_hosts(), optionally quietly */
+static pid_t
+run_ssh(char **argv, bool quiet)
+{
+	pid_t pid;
+	int fd;
+
+	if ((pid = fork()) == -1)
+		err(1, "fork");
+	if (pid)
+		return pid;
+
+	if ((fd = open("/dev/null", O_RDWR)) != -1) {
+		dup2(fd, STDOUT_FILENO);
+		if (quiet)
+			dup2(fd, STDERR_FILENO);
+	}
+
+	execvp(argv[0], argv);
+	err(1, "%s", argv[0]);
+}
+
+/*
+ * ssh command line for running args in the directory on the host, through
+ * the master connection, as "cd 'dir' && exec 'arg'...". Relative
+ * directories are taken to be relative to our working directory there
+ * too, as for mirrored trees. Valid until the next call.
+ */
+static char **
+host_argv(struct host *host, const char *directory, char **args)
+{
+	static char *argv[12];
+	static char *script;
+	char *abs, *quoted, *p;
+	size_t len;
+	int i;
+
+	free(script);
+
+	if (!(abs = absolute_path(directory)))
+		err(1, "malloc");
+
+	/* sh_quote() at most quadruples, plus the quotes and a space */
+	len = strlen(abs) * 4 + 16;
+	for (i = 0; args[i]; i++)
+		len += strlen(args[i]) * 4 + 3;
+	if (!(script = malloc(len)))
+		err(1, "malloc");
+
+	quoted = sh_quote(abs);
+	p = script + sprintf(script, "cd %s && exec", quoted);
+	free(quoted);
+	free(abs);
+
+	for (i = 0; args[i]; i++) {
+		quoted = sh_quote(args[i]);
+		p += sprintf(p, " %s", quoted);
+		free(quoted);
+	}
+
+	i = 0;
+	argv[i++] = "ssh";
+	argv[i++] = "-T";	/* no terminal, keeping stderr apart */
+	if (!stdin_broadcast)
+		argv[i++] = "-n";	/* nor our stdin */
+	argv[i++] = "-o";
+	argv[i++] = "ControlMaster=no";
+	argv[i++] = "-S";
+	argv[i++] = host->control;
+	argv[i++] = "--";
+	argv[i++] = host->name;
+	argv[i++] = script;
+	argv[i] = NULL;
+
+	return argv;
+}
+
+/* s in single quotes for sh, to be freed */
+static char *
+sh_quote(const char *s)
+{
+	char *quoted, *p;
+
+	/* worst case every character is a quote, each taking 4 */
+	if (!(quoted = malloc(strlen(s) * 4 + 3)))
+		err(1, "malloc");
+
+	p = quoted;
+	*p++ = '\'';
+	for (; *s; s++)
+		if (*s == '\'') {
+			memcpy(p, "'\\''", 4);
+			p += 4;
+		} else
+			*p++ = *s;
+	*p++ = '\'';
+	*p = '\0';
+
+	return quoted;
+}
+
+/* -j auto: CPUs we may run on, less if a cgroup quota says so */
+static int
+auto_jobs(void)
+{
+	long n;
+	double quota;
+#if defined(__linux__)
+	cpu_set_t set;
+#endif
+
+	if ((n = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		n = 1;
+#if defined(__linux__)
+	if (!sched_getaffinity(0, sizeof(set), &set) && CPU_COUNT(&set) < n)
+		n = CPU_COUNT(&set);
+#endif
+	/* 1.5 CPUs worth of quota makes 2 jobs */
+	if ((quota = cgroup_cpu_quota()) > 0 && quota < n)
+		n = MAX(1, (long)(quota + 0.999));
+
+	return (int)n;
+}
+
+/*
+ * The CPU quota of our cgroup, in CPUs, from cgroup v2's cpu.max or v1's
+ * cfs_quota_us. Returns 0 if there's none or no cgroups at all.
+ */
+static double
+cgroup_cpu_quota(void)
+{
+	char line[PATH_MAX], *group, *ctrl, *p;
+	double quota = 0, q;
+	bool has_cpu;
+	FILE *f;
+
+	if (!(f = fopen("/proc/self/cgroup", "r")))
+		return 0;
+
+	/* "0::/path" for v2, "4:cpu,cpuacct:/path" for v1 */
+	while (fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "\n")] = '\0';
+		if (!(ctrl = strchr(line, ':')) ||
+		    !(group = strchr(++ctrl, ':')))
+			continue;
+		*group++ = '\0';
+
+		has_cpu = false;
+		for (p = ctrl; p; p = strchr(p, ',')) {
+			if (*p == ',')
+				p++;
+			if (!strncmp(p, "cpu", 3) && (!p[3] || p[3] == ','))
+				has_cpu = true;
+		}
+
+		if (!*ctrl)
+			q = cgroup_walk("/sys/fs/cgroup", group, true);
+		else if (has_cpu)
+			q = cgroup_walk("/sys/fs/cgroup/cpu", group, false);
+		else
+			continue;
+
+		if (q > 0 && (!quota || q < quota))
+			quota = q;
+	}
+
+	fclose(f);
+	return quota;
+}
+
+/* lowest quota in CPUs of the group under base and its parents, or 0 */
+static double
+cgroup_walk(const char *base, const char *group, bool v2)
+{
+	char path[PATH_MAX];
+	char *p;
+	double quota = 0;
+	long max, period;
+	size_t base_len;
+	FILE *f;
+
+	base_len = strlen(base);
+	if (snprintf(path, sizeof(path), "%s%s", base, group) >=
+	    (int)sizeof(path))
+		return 0;
+
+	while (1) {
+		/* strip trailing slashes, e.g. for "/" */
+		p = path + strlen(path);
+		while (p > path + base_len && p[-1] == '/')
+			*--p = '\0';
+
+		max = period = 0;
+		if (v2) {
+			snprintf(p, sizeof(path) - (size_t)(p-path),
+			    "/cpu.max");
+			/* "max 100000" fails to parse; no limit */
+			if ((f = fopen(path, "r"))) {
+				if (fscanf(f, "%ld %ld", &max, &period) != 2)
+					max = 0;
+				fclose(f);
+			}
+		} else {
+			snprintf(p, sizeof(path) - (size_t)(p-path),
+			    "/cpu.cfs_quota_us");
+			if ((f = fopen(path, "r"))) {
+				if (fscanf(f, "%ld", &max) != 1)
+					max = 0;
+				fclose(f);
+			}
+			snprintf(p, sizeof(path) - (size_t)(p-path),
+			    "/cpu.cfs_period_us");
+			if ((f = fopen(path, "r"))) {
+				if (fscanf(f, "%ld", &period) != 1)
+					period = 0;
+				fclose(f);
+			}
+		}
+		*p = '\0';
+
+		if (max > 0 && period > 0 &&
+		    (!quota || (double)max / period < quota))
+			quota = (double)max / period;
+
+		if (p == path + base_len || !(p = strrchr(path, '/')) ||
+		    p < path + base_len)
+			break;
+		*p = '\0';
+	}
+
+	return quota;
+}
+
+/*
+ * Whether to start another job with -l or --mem-free. The load and memory
+ * are sampled every ADMIT_INTERVAL at most. Like make, jobs started since
+ * the sample count towards the load as they don't show in it yet. A job
+ * may always be started if there are none running.
+ */
+static bool
+may_start(int num_jobs)
+{
+	double t;
+
+	if (!max_load && !min_mem_free)
+		return true;
+	if (!num_jobs)
+		return true;
+
+	if ((t = now()) >= admit_next) {
+		admit_next = t + ADMIT_INTERVAL;
+		admit_started = 0;
+		if (max_load && getloadavg(&admit_load, 1) != 1)
+			admit_load = 0;
+		admit_mem_ok = !min_mem_free ||
+		    mem_available() >= min_mem_free;
+	}
+
+	if (admit_mem_ok &&
+	    (!max_load || admit_load + admit_started < max_load))
+		return true;
+
+	timer_set(&admit_timer, admit_next);
+	return false;
+}
+
+/* memory available for new processes, in bytes */
+static size_t
+mem_available(void)
+{
+#if defined(__linux__)
+	/* MemAvailable counts reclaimable page cache, unlike AVPHYS_PAGES */
+	char line[256];
+	unsigned long kb;
+	FILE *f;
+
+	if ((f = fopen("/proc/meminfo", "r"))) {
+		while (fgets(line, sizeof(line), f)) {
+			if (sscanf(line, "MemAvailable: %lu kB", &kb) == 1) {
+				fclose(f);
+				return (size_t)kb * 1024;
+			}
+		}
+		fclose(f);
+	}
+#endif
+#if defined(_SC_AVPHYS_PAGES)
+	return (size_t)sysconf(_SC_AVPHYS_PAGES) *
+	    (size_t)sysconf(_SC_PAGESIZE);
+#else
+	return SIZE_MAX;
+#endif
+}
+
+/*
+ * Whether the jobs' nice value can be lowered by incr, which takes root,
+ * CAP_SYS_NICE or enough of RLIMIT_NICE. Tried on ourselves, then undone,
+ * as raising it is always allowed.
+ */
+static bool
+can_nice(int incr)
+{
+	int cur;
+
+	errno = 0;
+	if ((cur = getpriority(PRIO_PROCESS, 0)) == -1 && errno)
+		return false;
+	if (setpriority(PRIO_PROCESS, 0, cur + incr) == -1)
+		return false;
+	if (setpriority(PRIO_PROCESS, 0, cur) == -1)
+		err(1, "setpriority");
+
+	return true;
+}
+
+/*
+ * err() for the child of fork_job(), where exit() would run our atexit()
+ * handlers, among others stopping the ssh masters. 126, as sh uses for a
+ * command it can't run.
+ */
+static void
+child_fail(const char *what)
+{
+	warn("%s", what);
+	_exit(126);
+}
+
+static pid_t
+fork_job(char **argv, int dir_fd, int in_fd, int out_fd, int err_fd,
+    int slot)
+{
+#if defined(USE_PIN)
+	struct pin *pin;
+#endif
+	sigset_t fwd, old;
+	pid_t pid;
+	int fd, status;
+
+	/* a forwarded signal must not hit our handler in the child */
+	if (use_pgroups) {
+		sigemptyset(&fwd);
+		sigaddset(&fwd, SIGINT);
+		sigaddset(&fwd, SIGTERM);
+		sigaddset(&fwd, SIGHUP);
+		pthread_sigmask(SIG_BLOCK, &fwd, &old);
+	}
+
+	if ((pid = fork()) == -1)
+		err(1, "fork");
+	if (pid) {
+		/* in both, so it's done before either goes on */
+		if (use_pgroups) {
+			setpgid(pid, pid);
+			pthread_sigmask(SIG_SETMASK, &old, NULL);
+		}
+		return pid;
+	}
+
+	if (use_pgroups) {
+		setpgid(0, 0);
+		signal(SIGINT, SIG_DFL);
+		signal(SIGTERM, SIG_DFL);
+		signal(SIGHUP, SIG_DFL);
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+	}
+
+	/* the pipes are close-on-exec, dup2() clears that for stdout/err */
+	if (dup2(out_fd, STDOUT_FILENO) == -1)
+		child_fail("dup2 stdout");
+	if (dup2(err_fd, STDERR_FILENO) == -1)
+		child_fail("dup2 stderr");
+	if (in_fd != -1 && dup2(in_fd, STDIN_FILENO) == -1)
+		child_fail("dup2 stdin");
+	if (input_stdin && (fd = open("/dev/null", O_RDONLY)) != -1)
+		dup2(fd, STDIN_FILENO);
+	/* we ignore it for --stdin-broadcast, which exec() keeps */
+	if (stdin_broadcast)
+		signal(SIGPIPE, SIG_DFL);
+
+	if (dir_fd != -1 && fchdir(dir_fd) == -1)
+		child_fail("fchdir");
+
+	/* "0" is whoever writes it */
+	if (cgroup_fd != -1 && write(cgroup_fd, "0", 1) == -1)
+		child_fail(cgroup_path);
+	errno = 0;
+	if (job_nice && nice(job_nice) == -1 && errno)
+		child_fail("nice");
+#if defined(USE_IOPRIO)
+	if (io_prio && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+	    io_prio) == -1)
+		child_fail("ioprio_set");
+#endif
+
+#if defined(USE_PIN)
+	if (pins) {
+		pin = &pins[slot];
+		if (sched_setaffinity(0, sizeof(pin->cpus), &pin->cpus) == -1)
+			child_fail("sched_setaffinity");
+		if (pin_mode == PIN_NUMA && pin->nodes &&
+		    syscall(SYS_set_mempolicy, MPOL_BIND, &pin->nodes,
+		    sizeof(pin->nodes) * CHAR_BIT + 1) == -1)
+			child_fail("set_mempolicy");
+		/* prepared, as we shouldn't allocate here */
+		environ = pin->envp;
+	}
+#else
+	(void)slot;
+#endif
+
+	execvp(argv[0], argv);
+	status = errno == ENOENT ? 127 : 126;
+	warn("%s", argv[0]);
+	_exit(status);
+}
+
+#if defined(USE_SPAWN)
+/*
+ * posix_spawn() avoids copying our page tables, which dominates the cost of
+ * starting short commands. Returns -1 and sets errno on failure, which may
+ * be an fchdir() or exec error. Some implementations instead report exec
+ * errors through exit status 127. in_fd may be -1 to leave stdin be.
+ */
+static pid_t
+spawn_job(char **argv, int dir_fd, int in_fd, int out_fd, int err_fd)
+{
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	sigset_t sigdef;
+	short flags = 0;
+	pid_t pid;
+	int error;
+
+	if ((errno = posix_spawn_file_actions_init(&actions)))
+		err(1, "posix_spawn_file_actions_init");
+	if ((in_fd != -1 && (error = posix_spawn_file_actions_adddup2(
+	    &actions, in_fd, STDIN_FILENO))) ||
+	    (error = posix_spawn_file_actions_adddup2(&actions, out_fd,
+	    STDOUT_FILENO)) ||
+	    (error = posix_spawn_file_actions_adddup2(&actions, err_fd,
+	    STDERR_FILENO)) ||
+	    (input_stdin && (error = posix_spawn_file_actions_addopen(
+	    &actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0))) ||
+	    (dir_fd != -1 && (error = posix_spawn_file_actions_addfchdir_np(
+	    &actions, dir_fd)))) {
+		errno = error;
+		err(1, "posix_spawn_file_actions");
+	}
+
+	if ((errno = posix_spawnattr_init(&attr)))
+		err(1, "posix_spawnattr_init");
+	if (use_pgroups) {
+		flags |= POSIX_SPAWN_SETPGROUP;
+		if ((errno = posix_spawnattr_setpgroup(&attr, 0)))
+			err(1, "posix_spawnattr_setpgroup");
+	}
+	/* we ignore it for --stdin-broadcast, which exec() keeps */
+	if (stdin_broadcast) {
+		flags |= POSIX_SPAWN_SETSIGDEF;
+		sigemptyset(&sigdef);
+		sigaddset(&sigdef, SIGPIPE);
+		if ((errno = posix_spawnattr_setsigdefault(&attr, &sigdef)))
+			err(1, "posix_spawnattr_setsigdefault");
+	}
+	if ((errno = posix_spawnattr_setflags(&attr, flags)))
+		err(1, "posix_spawnattr_setflags");
+
+	error = posix_spawnp(&pid, argv[0], &actions, &attr, argv, environ);
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attr);
+
+	if (error) {
+		errno = error;
+		return -1;
+	}
+
+	return pid;
+}
+#endif
+
+/*
+ * Sets up --cgroup, a cgroup v2 group for all jobs to share: creates it if
+ * needed, sets its CPU and I/O weights, and opens its cgroup.procs, which
+ * the children write themselves into before exec.
+ */
+static void
+start_cgroup(void)
+{
+	static const char *const weights[] = { "cpu.weight", "io.weight" };
+#if defined(USE_CGROUP)
+	struct statfs st;
+#endif
+	int dir_fd, fd;
+	size_t i;
+
+	if (!mkdir(cgroup_path, 0755)) {
+		cgroup_made = true;
+		atexit(remove_cgroup);
+	} else if (errno != EEXIST)
+		err(1, "%s", cgroup_path);
+
+	if ((dir_fd = open(cgroup_path, O_RDONLY | O_DIRECTORY |
+	    O_CLOEXEC)) == -1)
+		err(1, "%s", cgroup_path);
+#if defined(USE_CGROUP)
+	if (fstatfs(dir_fd, &st) == -1)
+		err(1, "%s", cgroup_path);
+	if (st.f_type != CGROUP2_MAGIC)
+		errx(1, "%s: not in a cgroup v2 hierarchy", cgroup_path);
+#endif
+	if ((cgroup_fd = openat(dir_fd, "cgroup.procs", O_WRONLY |
+	    O_CLOEXEC)) == -1)
+		err(1, "%s/cgroup.procs", cgroup_path);
+
+	for (i = 0; cgroup_weight && i < LEN(weights); i++) {
+		if ((fd = openat(dir_fd, weights[i], O_WRONLY |
+		    O_CLOEXEC)) == -1) {
+			/* controller not enabled in the parent */
+			if (errno == ENOENT) {
+				warnx("%s: no %s", cgroup_path, weights[i]);
+				continue;
+			}
+			err(1, "%s/%s", cgroup_path, weights[i]);
+		}
+		if (dprintf(fd, "%s%d\n", i ? "default " : "",
+		    cgroup_weight) < 0)
+			err(1, "%s/%s", cgroup_path, weights[i]);
+		close(fd);
+	}
+
+	close(dir_fd);
+}
+
+/* fails harmlessly if something's still in there */
+static void
+remove_cgroup(void)
+{
+	if (cgroup_made)
+		rmdir(cgroup_path);
+}
+
+#if defined(USE_PIN)
+/*
+ * Divides the CPUs we may run on between the job slots, as evenly as
+ * possible. CPUs are taken node by node so slots don't straddle NUMA nodes
+ * unless they must. With more slots than CPUs, slots share CPUs.
+ */
+static void
+init_pins(void)
+{
+	static int order[CPU_SETSIZE], node_of[CPU_SETSIZE];
+	cpu_set_t allowed, node_cpus;
+	char path[64], list[8192], *env;
+	int num_cpus = 0, num_env, node, cpu, i, j, k, from, to;
+	FILE *f;
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
+		err(1, "sched_getaffinity");
+	if (pin_mode == PIN_NUMA &&
+	    syscall(SYS_get_mempolicy, NULL, NULL, 0, NULL, 0) == -1)
+		err(1, "--pin=numa");
+
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+		node_of[cpu] = -1;
+
+	for (node = 0; node < (int)(sizeof(pins->nodes) * CHAR_BIT); node++) {
+		snprintf(path, sizeof(path),
+		    "/sys/devices/system/node/node%d/cpulist", node);
+		if (!(f = fopen(path, "r")))
+			continue;
+		if (fgets(list, sizeof(list), f) &&
+		    parse_cpulist(list, &node_cpus)) {
+			for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+				if (!CPU_ISSET(cpu, &node_cpus) ||
+				    !CPU_ISSET(cpu, &allowed) ||
+				    node_of[cpu] != -1)
+					continue;
+				node_of[cpu] = node;
+				order[num_cpus++] = cpu;
+			}
+		}
+		fclose(f);
+	}
+
+	/* no NUMA information */
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+		if (CPU_ISSET(cpu, &allowed) && node_of[cpu] == -1)
+			order[num_cpus++] = cpu;
+
+	for (num_env = 0; environ[num_env]; num_env++)
+		;
+
+	if (!(pins = calloc((size_t)max_jobs, sizeof(*pins))))
+		err(1, "calloc");
+
+	for (i = 0; i < max_jobs; i++) {
+		if (max_jobs <= num_cpus) {
+			from = i * num_cpus / max_jobs;
+			to = (i+1) * num_cpus / max_jobs;
+		} else {
+			from = i % num_cpus;
+			to = from + 1;
+		}
+
+		CPU_ZERO(&pins[i].cpus);
+		for (j = from; j < to; j++) {
+			CPU_SET(order[j], &pins[i].cpus);
+			if (node_of[order[j]] != -1)
+				pins[i].nodes |= 1UL << node_of[order[j]];
+		}
+
+		format_cpulist(&pins[i].cpus, list, sizeof(list));
+		if (asprintf(&env, "WITHIN_CPUS=%s", list) == -1)
+			err(1, "asprintf");
+
+		pins[i].envp = calloc((size_t)num_env + 2, sizeof(char *));
+		if (!pins[i].envp)
+			err(1, "calloc");
+		for (j = 0, k = 0; j < num_env; j++)
+			if (strncmp(environ[j], "WITHIN_CPUS=", 12))
+				pins[i].envp[k++] = environ[j];
+		pins[i].envp[k] = env;
+	}
+}
+
+/* parses a list like "0-3,8-11", returning false if malformed */
+static bool
+parse_cpulist(const char *s, cpu_set_t *set)
+{
+	long from, to;
+	char *end;
+
+	CPU_ZERO(set);
+
+	while (*s && *s != '\n') {
+		from = to = strtol(s, &end, 10);
+		if (end == s)
+			return false;
+		if (*end == '-') {
+			s = end+1;
+			to = strtol(s, &end, 10);
+			if (end == s)
+				return false;
+		}
+		if (from < 0 || to >= CPU_SETSIZE)
+			return false;
+		for (; from <= to; from++)
+			CPU_SET(from, set);
+		s = *end == ',' ? end+1 : end;
+	}
+
+	return true;
+}
+
+/* the reverse of parse_cpulist() */
+static void
+format_cpulist(const cpu_set_t *set, char *buf, size_t size)
+{
+	size_t len = 0;
+	int from, to;
+
+	buf[0] = '\0';
+
+	for (from = 0; from < CPU_SETSIZE; from = to+1) {
+		if (!CPU_ISSET(from, set)) {
+			to = from;
+			continue;
+		}
+		for (to = from; to+1 < CPU_SETSIZE && CPU_ISSET(to+1, set);
+		    to++)
+			;
+		if (from == to)
+			len += (size_t)snprintf(buf + len, size - len,
+			    "%s%d", len ? "," : "", from);
+		else
+			len += (size_t)snprintf(buf + len, size - len,
+			    "%s%d-%d", len ? "," : "", from, to);
+		if (len >= size)
+			errx(1, "CPU list too long");
+	}
+}
+#endif
+
+/* pipe() with both ends close-on-exec */
+static void
+make_pipe(int fds[2])
+{
+	if (pipe(fds) == -1)
+		err(1, "pipe");
+	if (fcntl(fds[0], F_SETFD, FD_CLOEXEC) == -1 ||
+	    fcntl(fds[1], F_SETFD, FD_CLOEXEC) == -1)
+		err(1, "F_SETFD");
+}
+
+/* stream is 0 for stdout, 1 for stderr */
+static void
+start_piper(struct job *job, int stream, int in_fd)
+{
+	struct piper *piper;
+	size_t len, host_len;
+	int flags, out;
+
+	if (out_format == FORMAT_JSONL)
+		len = json_prefix(&job->prefix, &job->prefix_cap,
+		    job->directory, job->host);
+	else {
+		len = strlen(job->directory);
+		host_len = job->host ? strlen(job->host->name) + 1 : 0;
+		/* room for "host:", ": " and the terminator */
+		if (job->prefix_cap < host_len + len + 3) {
+			job->prefix_cap = host_len + len + 3;
+			if (!(job->prefix = realloc(job->prefix,
+			    job->prefix_cap)))
+				err(1, "realloc");
+		}
+		if (host_len) {
+			memcpy(job->prefix, job->host->name, host_len - 1);
+			job->prefix[host_len - 1] = ':';
+		}
+		memcpy(job->prefix + host_len, job->directory, len);
+		memcpy(job->prefix + host_len + len, ": ", 3);
+		len += host_len + 2;
+	}
+
+	/* records of both streams go to stdout, in order */
+	out = out_format == FORMAT_JSONL ? 0 : stream;
+
+	/* the pending buffer is kept for reuse, but should be empty */
+	piper = &job->pipers[stream];
+	piper->in_fd = in_fd;
+	piper->sink = &sinks[out];
+	piper->out_fd = piper->sink->fd;
+	piper->newline = 1;
+	piper->pending.spill_fd = -1;
+	piper->pending.piper = piper;
+	piper->prefix = job->prefix;
+	piper->prefix_len = len;
+	piper->stream = stream;
+	piper->job = job;
+	piper->part_len = 0;
+
+	if ((piper->group = job->group)) {
+		piper->hold = &job->group->out[out];
+		job->group->refs++;
+	} else
+		piper->hold = NULL;
+
+	if ((piper->cache = job->cache))
+		job->cache->refs++;
+
+#if defined(USE_URING)
+	/* left blocking, or io_uring fails reads with EAGAIN, not waits */
+	(void)flags;
+#else
+	if ((flags = fcntl(in_fd, F_GETFL)) == -1)
+		err(1, "F_GETFL");
+	if (fcntl(in_fd, F_SETFL, flags | O_NONBLOCK) == -1)
+		err(1, "F_SETFL");
+#endif
+
+	num_pipers++;
+	resume_piper(piper);
+}
+
+/*
+ * Copies available input to the output, prefixing every line. Lines are
+ * found with memchr() and handed to writev() as-is, interleaved with the
+ * prefix, so there's no per-byte work or copying.
+ */
+static void
+run_piper(struct piper *piper)
+{
+	char buf[4096];
+	ssize_t num_read;
+
+	if (no_prefix) {
+		run_raw_piper(piper);
+		return;
+	}
+
+	/* piper_write() may pause us */
+	while (piper->reading &&
+	    (num_read = read(piper->in_fd, buf, sizeof(buf))) > 0) {
+		if (piper->cache)
+			cache_record(piper->cache, piper->stream,
+			    buf, (size_t)num_read);
+		piper_feed(piper, buf, (size_t)num_read);
+	}
+
+	if (!piper->reading)
+		return;
+	if (num_read == 0)
+		piper_eof(piper);
+	else if (num_read == -1 && errno != EAGAIN)
+		err(1, "read");
+}
+
+/* prefixes and writes output read by run_piper() or from the cache */
+static void
+piper_feed(struct piper *piper, char *buf, size_t len)
+{
+	struct iovec iov[PIPER_IOVS];
+	char *p, *end, *nl;
+	int niov = 0;
+
+	if (no_prefix) {
+		iov[0].iov_base = buf;
+		iov[0].iov_len = len;
+		piper_write(piper, iov, 1);
+		return;
+	}
+	if (out_format == FORMAT_JSONL) {
+		json_feed(piper, buf, len);
+		return;
+	}
+
+	p = buf;
+	end = buf + len;
+
+	while (p < end) {
+		if (niov > PIPER_IOVS-2) {
+			piper_write(piper, iov, niov);
+			niov = 0;
+		}
+
+		if (piper->newline) {
+			iov[niov].iov_base = piper->prefix;
+			iov[niov].iov_len = piper->prefix_len;
+			niov++;
+		}
+
+		nl = memchr(p, '\n', (size_t)(end-p));
+		piper->newline = nl != NULL;
+		iov[niov].iov_base = p;
+		iov[niov].iov_len = (size_t)((nl ? nl+1 : end) - p);
+		p += iov[niov].iov_len;
+		niov++;
+	}
+
+	piper_write(piper, iov, niov);
+}
+
+/*
+ * --format=jsonl: every line of output becomes a record like
+ *
+ *	{"dir":"a","stream":"stderr","time":1.502113,"line":"..."}
+ *
+ * and jobs get "start" and "exit" records. The "dir" (and "host") part is
+ * built once per job; this sets it up as {"dir":"...", in *buf.
+ */
+static size_t
+json_prefix(char **buf, size_t *cap, const char *directory,
+    const struct host *host)
+{
+	size_t dir_len, host_len, need, len;
+
+	dir_len = strlen(directory);
+	host_len = host ? strlen(host->name) : 0;
+	need = 32 + 6 * (dir_len + host_len);
+	if (*cap < need) {
+		*cap = need;
+		if (!(*buf = realloc(*buf, *cap)))
+			err(1, "realloc");
+	}
+
+	memcpy(*buf, "{\"dir\":\"", 8);
+	len = 8 + json_escape(*buf + 8, directory, dir_len);
+	if (host) {
+		memcpy(*buf + len, "\",\"host\":\"", 10);
+		len += 10;
+		len += json_escape(*buf + len, host->name, host_len);
+	}
+	memcpy(*buf + len, "\",", 3);
+
+	return len + 2;
+}
+
+/*
+ * Returns how many bytes at the start of s need no escaping, looking at
+ * eight at a time: subtracting borrows into the high bit of a byte that's
+ * below 0x20 or, XORed with '"' or '\\', zero. Bytes from 0x80 stop it
+ * first, for json_escape() to check the UTF-8.
+ */
+static size_t
+json_plain(const char *s, size_t len)
+{
+	const uint64_t ones = 0x0101010101010101ULL;
+	const uint64_t highs = 0x8080808080808080ULL;
+	uint64_t v, q, b;
+	size_t i;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		memcpy(&v, s + i, 8);
+		q = v ^ (ones * '"');
+		b = v ^ (ones * '\\');
+		if ((v & highs) ||
+		    ((v - ones * 0x20) | (q - ones) | (b - ones)) & highs)
+			break;
+	}
+
+	/* the rest, or the word that has one */
+	for (; i < len; i++)
+		if ((unsigned char)s[i] < 0x20 ||
+		    (unsigned char)s[i] >= 0x80 || s[i] == '"' || s[i] == '\\')
+			break;
+
+	return i;
+}
+
+/*
+ * Length of the UTF-8 sequence at s, or 0 if it isn't one: cut short,
+ * overlong, a surrogate or past U+10FFFF, as in RFC 3629.
+ */
+static size_t
+utf8_len(const unsigned char *s, size_t len)
+{
+	unsigned char lo = 0x80, hi = 0xbf;
+	size_t n, i;
+
+	if (s[0] < 0x80)
+		return 1;
+	else if (s[0] < 0xc2)
+		return 0;
+	else if (s[0] < 0xe0)
+		n = 2;
+	else if (s[0] < 0xf0) {
+		n = 3;
+		if (s[0] == 0xe0)
+			lo = 0xa0;
+		else if (s[0] == 0xed)
+			hi = 0x9f;
+	} else if (s[0] < 0xf5) {
+		n = 4;
+		if (s[0] == 0xf0)
+			lo = 0x90;
+		else if (s[0] == 0xf4)
+			hi = 0x8f;
+	} else
+		return 0;
+
+	if (len < n || s[1] < lo || s[1] > hi)
+		return 0;
+	for (i = 2; i < n; i++)
+		if ((s[i] & 0xc0) != 0x80)
+			return 0;
+
+	return n;
+}
+
+/* how many bytes at the end of s are a UTF-8 sequence that's cut short */
+static size_t
+utf8_cut(const char *s, size_t len)
+{
+	unsigned char c;
+	size_t k;
+
+	for (k = 1; k <= 3 && k <= len; k++) {
+		c = (unsigned char)s[len-k];
+		if ((c & 0xc0) == 0x80)
+			continue;
+		if ((c >= 0xc2 && c < 0xe0 && k < 2) ||
+		    (c >= 0xe0 && c < 0xf0 && k < 3) ||
+		    (c >= 0xf0 && c < 0xf5 && k < 4))
+			return k;
+		break;
+	}
+
+	return 0;
+}
+
+/*
+ * Writes s escaped to out, which must have room for 6 * len bytes. Bytes
+ * that aren't valid UTF-8 become U+FFFD, as JSON has no way to say them.
+ */
+static size_t
+json_escape(char *out, const char *s, size_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+	unsigned char c;
+	size_t i = 0, n, o = 0;
+
+	while (i < len) {
+		n = json_plain(s + i, len - i);
+		memcpy(out + o, s + i, n);
+		o += n;
+		if ((i += n) == len)
+			break;
+
+		if ((c = (unsigned char)s[i]) >= 0x80) {
+			if ((n = utf8_len((const unsigned char *)s + i,
+			    len - i))) {
+				memcpy(out + o, s + i, n);
+				o += n;
+				i += n;
+			} else {
+				memcpy(out + o, "\\ufffd", 6);
+				o += 6;
+				i++;
+			}
+			continue;
+		}
+
+		out[o++] = '\\';
+		switch ((c = (unsigned char)s[i++])) {
+		case '"':  out[o++] = '"'; break;
+		case '\\': out[o++] = '\\'; break;
+		case '\n': out[o++] = 'n'; break;
+		case '\r': out[o++] = 'r'; break;
+		case '\t': out[o++] = 't'; break;
+		default:
+			memcpy(out + o, "u00", 3);
+			out[o+3] = hex[c >> 4];
+			out[o+4] = hex[c & 15];
+			o += 5;
+			break;
+		}
+	}
+
+	return o;
+}
+
+/*
+ * Makes records of the complete lines in buf, all with the same time as
+ * they came in with one read(), and writes them out together. The start
+ * of an unfinished line is kept, up to PIPER_PENDING_MAX.
+ */
+static void
+json_feed(struct piper *piper, const char *buf, size_t len)
+{
+	struct iovec iov;
+	const char *p, *end, *nl;
+	char mid[64];
+	size_t n, mid_len;
+
+	mid_len = json_middle(mid, sizeof(mid), piper);
+	json_len = 0;
+
+	for (p = buf, end = buf + len; p < end; p = nl+1) {
+		if ((nl = memchr(p, '\n', (size_t)(end-p)))) {
+			json_line(piper, mid, mid_len, p, (size_t)(nl-p));
+			continue;
+		}
+
+		n = (size_t)(end-p);
+		if (piper->part_len + n > PIPER_PENDING_MAX) {
+			/* too long, but a character cut short waits for more */
+			n -= utf8_cut(p, n);
+			json_line(piper, mid, mid_len, p, n);
+			p += n;
+			n = (size_t)(end-p);
+		}
+		if (piper->part_cap < piper->part_len + n) {
+			piper->part_cap = MAX(piper->part_len + n, 256);
+			if (!(piper->part = realloc(piper->part,
+			    piper->part_cap)))
+				err(1, "realloc");
+		}
+		memcpy(piper->part + piper->part_len, p, n);
+		piper->part_len += n;
+		break;
+	}
+
+	if (json_len) {
+		iov.iov_base = json_buf;
+		iov.iov_len = json_len;
+		piper_write(piper, &iov, 1);
+	}
+}
+
+/* what goes between the prefix and the line, the same for a whole read */
+static size_t
+json_middle(char *buf, size_t size, const struct piper *piper)
+{
+	static const char *streams[] = { "stdout", "stderr" };
+
+	return (size_t)snprintf(buf, size,
+	    "\"stream\":\"%s\",\"time\":%.6f,\"line\":\"",
+	    streams[piper->stream], now() - json_epoch);
+}
+
+/* appends a record to json_buf of what was kept, followed by s */
+static void
+json_line(struct piper *piper, const char *mid, size_t mid_len,
+    const char *s, size_t len)
+{
+	size_t need;
+
+	/* escaped as one, or a character split between reads would be lost */
+	if (piper->part_len && len) {
+		if (piper->part_cap < piper->part_len + len) {
+			piper->part_cap = piper->part_len + len;
+			if (!(piper->part = realloc(piper->part,
+			    piper->part_cap)))
+				err(1, "realloc");
+		}
+		memcpy(piper->part + piper->part_len, s, len);
+		piper->part_len += len;
+		len = 0;
+	}
+
+	need = json_len + piper->prefix_len + mid_len + 3 +
+	    6 * (piper->part_len + len);
+	if (json_cap < need) {
+		json_cap = MAX(need, json_cap * 2);
+		if (!(json_buf = realloc(json_buf, json_cap)))
+			err(1, "realloc");
+	}
+
+	memcpy(json_buf + json_len, piper->prefix, piper->prefix_len);
+	json_len += piper->prefix_len;
+	memcpy(json_buf + json_len, mid, mid_len);
+	json_len += mid_len;
+	json_len += json_escape(json_buf + json_len, piper->part,
+	    piper->part_len);
+	json_len += json_escape(json_buf + json_len, s, len);
+	memcpy(json_buf + json_len, "\"}\n", 3);
+	json_len += 3;
+
+	piper->part_len = 0;
+}
+
+/*
+ * Adds a record for an unfinished last line, if any, to the group or the
+ * pending buffer. piper_eof() queues the latter.
+ */
+static void
+json_eof(struct piper *piper)
+{
+	struct iovec iov;
+	char mid[64];
+	size_t mid_len;
+
+	if (!piper->part_len)
+		return;
+
+	mid_len = json_middle(mid, sizeof(mid), piper);
+	json_len = 0;
+	json_line(piper, mid, mid_len, "", 0);
+
+	iov.iov_base = json_buf;
+	iov.iov_len = json_len;
+	if (piper->hold)
+		obuf_append(piper->hold, &iov, 1);
+	else {
+		obuf_append(&piper->pending, &iov, 1);
+		piper->pending.ready = piper->pending.len;
+	}
+}
+
+/* a "start" or "exit" record, to be freed, with what to put after "event" */
+static char *
+json_event(const char *prefix, size_t prefix_len, size_t *len,
+    const char *fmt, ...)
+{
+	va_list ap;
+	char *rest, *record;
+	int rest_len;
+
+	va_start(ap, fmt);
+	rest_len = vasprintf(&rest, fmt, ap);
+	va_end(ap);
+	if (rest_len == -1)
+		err(1, "vasprintf");
+
+	*len = prefix_len + 8 + (size_t)rest_len + 2;
+	if (!(record = malloc(*len)))
+		err(1, "malloc");
+	memcpy(record, prefix, prefix_len);
+	memcpy(record + prefix_len, "\"event\":", 8);
+	memcpy(record + prefix_len + 8, rest, (size_t)rest_len);
+	memcpy(record + *len - 2, "}\n", 2);
+
+	free(rest);
+	return record;
+}
+
+/*
+ * Writes out and frees a record, in the job's group if it has one. Other
+ * records go through a group of their own so that they're queued behind
+ * the output that came before them.
+ */
+static void
+json_emit(struct group *group, char *record, size_t len)
+{
+	struct iovec iov;
+
+	iov.iov_base = record;
+	iov.iov_len = len;
+
+	if (group)
+		obuf_append(&group->out[0], &iov, 1);
+	else {
+		group = new_group();
+		obuf_append(&group->out[0], &iov, 1);
+		release_group(group);
+	}
+
+	free(record);
+}
+
+/*
+ * Makes the record for a job that's been reaped. It's written once both
+ * of its pipers are done, so after all the job's output.
+ */
+static void
+json_exit(struct job *job, int status)
+{
+	char extra[48] = "";
+
+	snprintf(extra, sizeof(extra), "%s%s",
+	    job->timed_out ? ",\"timeout\":true" : "",
+	    job->retrying ? ",\"retrying\":true" : "");
+
+	if (WIFSIGNALED(status))
+		job->exit_record = json_event(job->prefix,
+		    job->pipers[0].prefix_len, &job->exit_len,
+		    "\"exit\",\"time\":%.6f,\"signal\":%d%s",
+		    now() - json_epoch, WTERMSIG(status), extra);
+	else
+		job->exit_record = json_event(job->prefix,
+		    job->pipers[0].prefix_len, &job->exit_len,
+		    "\"exit\",\"time\":%.6f,\"status\":%d%s",
+		    now() - json_epoch, WEXITSTATUS(status), extra);
+
+	if (job->pipers[0].in_fd == -1 && job->pipers[1].in_fd == -1)
+		json_exit_flush(job);
+}
+
+static void
+json_exit_flush(struct job *job)
+{
+	json_emit(job->group, job->exit_record, job->exit_len);
+	job->exit_record = NULL;
+}
+
+/* splice_piper() results */
+#define SPLICE_EMPTY	0	/* nothing more to read for now */
+#define SPLICE_EOF	1
+#define SPLICE_BLOCKED	2	/* output is full */
+#define SPLICE_NONE	3	/* not supported for this output */
+
+/*
+ * For --no-prefix. On Linux the data is moved straight from the job's pipe
+ * to the output with splice(), falling back to read() and write() if the
+ * output doesn't support that (e.g. a terminal). While the output is busy
+ * the piper waits its turn in the sink's queue, leaving the data in the
+ * job's pipe.
+ */
+static void
+run_raw_piper(struct piper *piper)
+{
+	char buf[65536];
+	struct iovec iov;
+	ssize_t num_read;
+
+	/* grouped or cached output has to pass through us */
+	if (!piper->group && !piper->cache && !piper->pending.queued) {
+		if (piper->sink->head) {
+			pause_piper(piper);
+			piper->splicing = true;
+			sink_queue(piper->sink, &piper->pending);
+			return;
+		}
+
+		switch (splice_piper(piper)) {
+		case SPLICE_EMPTY:
+			return;
+		case SPLICE_EOF:
+			piper_eof(piper);
+			return;
+		case SPLICE_BLOCKED:
+			pause_piper(piper);
+			piper->splicing = true;
+			sink_queue(piper->sink, &piper->pending);
+			return;
+		}
+	}
+
+	while (piper->reading &&
+	    (num_read = read(piper->in_fd, buf, sizeof(buf))) > 0) {
+		if (piper->cache)
+			cache_record(piper->cache, piper->stream,
+			    buf, (size_t)num_read);
+		iov.iov_base = buf;
+		iov.iov_len = (size_t)num_read;
+		piper_write(piper, &iov, 1);
+	}
+
+	if (!piper->reading)
+		return;
 	if (num_read == 0)
-		remove_piper(piper);
+		piper_eof(piper);
 	else if (num_read == -1 && errno != EAGAIN)
 		err(1, "read");
 }
 
+/* splices as much as possible, returning one of SPLICE_* */
+static int
+splice_piper(struct piper *piper)
+{
+#if defined(__linux__)
+	static bool no_splice[2];
+	struct pollfd pfd;
+	ssize_t nw;
+	int stream;
+
+	stream = (int)(piper->sink - sinks);
+	if (no_splice[stream])
+		return SPLICE_NONE;
+	if (progress_shown && piper->sink->tty)
+		clear_progress();
+
+	while (1) {
+		nw = splice(piper->in_fd, NULL, piper->out_fd, NULL, 1 << 20,
+		    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (nw > 0)
+			continue;
+		if (nw == 0)
+			return SPLICE_EOF;
+		if (errno == EINTR)
+			continue;
+		if (errno == EINVAL) {
+			no_splice[stream] = true;
+			return SPLICE_NONE;
+		}
+		if (errno != EAGAIN)
+			err(1, "splice");
+
+		/* SPLICE_F_NONBLOCK applies to both ends, see which it is */
+		pfd.fd = piper->in_fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 0) < 1)
+			return SPLICE_EMPTY;
+		return SPLICE_BLOCKED;
+	}
+#else
+	(void)piper;
+	return SPLICE_NONE;
+#endif
+}
+
+/*
+ * Writes output now or, with --group, holds on to it. If the output is
+ * busy or full the rest is kept in the piper's pending buffer, and
+ * reading stops when that gets too large.
+ */
+static void
+piper_write(struct piper *piper, struct iovec *iov, int niov)
+{
+	struct sink *sink = piper->sink;
+	struct obuf *buf = &piper->pending;
+#if !defined(USE_URING)
+	const char *last = NULL;
+	bool done;
+#endif
+	size_t end;
+
+	if (piper->hold) {
+		obuf_append(piper->hold, iov, niov);
+		return;
+	}
+
+	if (progress_shown && sink->tty)
+		clear_progress();
+
+	/* others first, USE_URING writes all through the queue */
+#if !defined(USE_URING)
+	if (!sink->head && (!sink->midline || sink->midline == buf)) {
+		done = write_some(piper->out_fd, &iov, &niov, &last);
+		if (last)
+			sink_mark(sink, buf, *last);
+		if (done)
+			return;
+	}
+#endif
+
+	obuf_append(buf, iov, niov);
+
+	/* hold back a partial line while others are waiting */
+	if (no_prefix || piper->newline)
+		buf->ready = buf->len;
+	else {
+		for (end = buf->len; end > buf->ready; end--)
+			if (buf->data[end-1] == '\n')
+				break;
+		buf->ready = end;
+	}
+	buf->rotated = false;
+
+	sink_queue(sink, buf);
+
+	if (buf->len - buf->off >= PIPER_PENDING_MAX)
+		pause_piper(piper);
+}
+
+/* closes the input, freeing the piper if its output has been written */
+static void
+piper_eof(struct piper *piper)
+{
+	struct job *job = piper->job;
+
+	pause_piper(piper);
+
+	if (close(piper->in_fd) == -1 && errno != EBADF)
+		err(1, "close");
+	piper->in_fd = -1;
+	if (out_format == FORMAT_JSONL)
+		json_eof(piper);
+	piper->pending.ready = piper->pending.len;
+
+	/* what json_eof() left has yet to be queued */
+	if (!piper->pending.queued) {
+		if (piper->pending.off < piper->pending.len)
+			sink_queue(piper->sink, &piper->pending);
+		else
+			free_piper(piper);
+	} else
+		sink_queue(piper->sink, &piper->pending);	/* may wait */
+
+	/* the job's exit comes after all its output */
+	if (job && job->exit_record && job->pipers[!piper->stream].in_fd == -1)
+		json_exit_flush(job);
+
+	if (piper->group)
+		release_group(piper->group);
+	if (piper->cache)
+		cache_release(piper->cache);
+}
+
+/* done with it, the slot can be reused */
+static void
+free_piper(struct piper *piper)
+{
+	/* no more to come of the line it started */
+	if (piper->sink->midline == &piper->pending)
+		piper->sink->midline = NULL;
+
+	/* don't hold on to what a flood left behind */
+	if (piper->pending.cap > PIPER_PENDING_MAX*2) {
+		free(piper->pending.data);
+		piper->pending.data = NULL;
+		piper->pending.cap = 0;
+	}
+
+	num_pipers--;
+}
+
+#if defined(USE_URING)
+/* a read that's already posted is still handled, see piper_data() */
+static void
+pause_piper(struct piper *piper)
+{
+	piper->reading = false;
+}
+
+static void
+resume_piper(struct piper *piper)
+{
+	if (!piper->reading) {
+		piper->reading = true;
+		if (!piper->posted) {
+			ev_read(piper->in_fd, piper);
+			piper->posted = true;
+		}
+	}
+}
+
+/*
+ * An ev_read() is done. Its data goes the same way as a read() in
+ * run_piper(), after which the read is posted again, unless that paused
+ * us. One posted before the pause still comes in, so a piper can end up
+ * with a buffer over PIPER_PENDING_MAX, but not two.
+ */
+static void
+piper_data(struct piper *piper, const struct event *ev)
+{
+	piper->posted = false;
+
+	if (ev->res > 0) {
+		if (piper->cache)
+			cache_record(piper->cache, piper->stream, ev->data,
+			    (size_t)ev->res);
+		piper_feed(piper, ev->data, (size_t)ev->res);
+	}
+	if (ev->bid != -1)
+		ev_give(ev->bid);
+
+	if (ev->res == 0)
+		piper_eof(piper);
+	else if (ev->res < 0 && ev->res != -EINTR && ev->res != -EAGAIN) {
+		errno = -ev->res;
+		err(1, "read");
+	} else if (piper->reading) {
+		ev_read(piper->in_fd, piper);
+		piper->posted = true;
+	}
+}
+#else
+static void
+pause_piper(struct piper *piper)
+{
+	if (piper->reading) {
+		ev_del(piper->in_fd, EV_READ);
+		piper->reading = false;
+	}
+}
+
+static void
+resume_piper(struct piper *piper)
+{
+	if (!piper->reading) {
+		ev_add(piper->in_fd, EV_READ, piper);
+		piper->reading = true;
+	}
+}
+#endif
+
+static struct group *
+new_group(void)
+{
+	struct group *group;
+
+	if (!(group = calloc(1, sizeof(*group))))
+		err(1, "calloc");
+
+	group->out[0].spill_fd = -1;
+	group->out[0].group = group;
+	group->out[1].spill_fd = -1;
+	group->out[1].group = group;
+	group->refs = 1;	/* the job's */
+	group->seq = group_seq++;
+
+	return group;
+}
+
+/*
+ * Drops a reference, flushing the output once the job is complete. With
+ * --keep-order that waits until all jobs started before it are flushed.
+ */
+static void
+release_group(struct group *group)
+{
+	struct group **gp;
+
+	if (--group->refs)
+		return;
+
+	if (!keep_order) {
+		flush_group(group);
+		return;
+	}
+
+	for (gp = &group_waiting; *gp && (*gp)->seq < group->seq;
+	    gp = &(*gp)->next)
+		;
+	group->next = *gp;
+	*gp = group;
+
+	while ((group = group_waiting) && group->seq == group_flush_seq) {
+		group_waiting = group->next;
+		group_flush_seq++;
+		flush_group(group);
+	}
+}
+
+/* queues the group's output, to be freed once written */
+static void
+flush_group(struct group *group)
+{
+	struct obuf *buf;
+	int i;
+
+	if (group->discard) {
+		for (i = 0; i < 2; i++) {
+			if (group->out[i].spill_fd != -1)
+				close(group->out[i].spill_fd);
+			free(group->out[i].data);
+		}
+		free(group);
+		return;
+	}
+
+	group->refs = 1;	/* ours, while queueing */
+
+	for (i = 0; i < 2; i++) {
+		buf = &group->out[i];
+		if (buf->spill_fd != -1 &&
+		    lseek(buf->spill_fd, 0, SEEK_SET) == -1)
+			err(1, "lseek");
+		if (buf->len || buf->spill_fd != -1) {
+			group->refs++;
+			sink_queue(&sinks[i], buf);
+		}
+	}
+
+	if (!--group->refs)
+		free(group);
+}
+
+static void
+obuf_append(struct obuf *buf, const struct iovec *iov, int niov)
+{
+	char path[] = "/tmp/within.XXXXXX";
+	struct iovec spill;
+	const char *tmpdir;
+	char *tmpl;
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < niov; i++)
+		len += iov[i].iov_len;
+
+	if (buf->group && buf->spill_fd == -1 &&
+	    buf->len + len > group_limit) {
+		/* took long enough, move everything to a file */
+		if ((tmpdir = getenv("TMPDIR")) && *tmpdir) {
+			if (asprintf(&tmpl, "%s/within.XXXXXX", tmpdir) == -1)
+				err(1, "asprintf");
+		} else
+			tmpl = path;
+		if ((buf->spill_fd = mkstemp(tmpl)) == -1)
+			err(1, "mkstemp");
+		unlink(tmpl);
+		if (tmpl != path)
+			free(tmpl);
+		fcntl(buf->spill_fd, F_SETFD, FD_CLOEXEC);
+
+		spill.iov_base = buf->data;
+		spill.iov_len = buf->len;
+		write_all(buf->spill_fd, &spill, 1);
+
+		free(buf->data);
+		buf->data = NULL;
+		buf->len = buf->cap = 0;
+	}
+
+	if (buf->spill_fd != -1) {
+		/* write_all() modifies the iovecs, use a copy */
+		struct iovec copy[PIPER_IOVS];
+
+		memcpy(copy, iov, (size_t)niov * sizeof(*iov));
+		write_all(buf->spill_fd, copy, niov);
+		return;
+	}
+
+#if defined(USE_URING)
+	/* a write still has the old data, see sink_wrote() */
+	if (buf->writing && buf->len + len > buf->cap) {
+		buf->cap = MAX(buf->cap*2, buf->len + len);
+		if (buf->stale) {
+			if (!(buf->data = realloc(buf->data, buf->cap)))
+				err(1, "realloc");
+		} else {
+			buf->stale = buf->data;
+			if (!(buf->data = malloc(buf->cap)))
+				err(1, "malloc");
+			memcpy(buf->data, buf->stale, buf->len);
+		}
+	}
+#endif
+
+	if (buf->len + len > buf->cap && buf->off) {
+		/* reclaim what's been written */
+		memmove(buf->data, buf->data + buf->off, buf->len - buf->off);
+		buf->len -= buf->off;
+		buf->ready -= MIN(buf->ready, buf->off);
+		buf->off = 0;
+	}
+
+	if (buf->len + len > buf->cap) {
+		buf->cap = MAX(buf->cap*2, buf->len + len);
+		if (!(buf->data = realloc(buf->data, buf->cap)))
+			err(1, "realloc");
+	}
+
+	for (i = 0; i < niov; i++) {
+		memcpy(buf->data + buf->len, iov[i].iov_base, iov[i].iov_len);
+		buf->len += iov[i].iov_len;
+	}
+}
+
+/*
+ * Makes standard output and error non-blocking, if that can be done
+ * without affecting other processes sharing them. On Linux they're
+ * reopened through /proc for a fresh file description; otherwise only
+ * pipes and sockets are changed, and restored on exit. Regular files
+ * never block.
+ */
+static void
+init_sinks(void)
+{
+	struct stat st;
+	int i, fd, flags;
+#if defined(__linux__) && !defined(USE_URING)
+	char path[32];
+	int new_fd;
+#endif
+
+	for (i = 0; i < 2; i++) {
+		sinks[i].fd = fd = STDOUT_FILENO + i;
+		sinks[i].flags = -1;
+		sinks[i].tail = &sinks[i].head;
+
+		if (fstat(fd, &st) == -1 || S_ISREG(st.st_mode))
+			continue;
+		if ((flags = fcntl(fd, F_GETFL)) == -1)
+			continue;
+		if (flags & O_NONBLOCK) {
+			sinks[i].nonblock = true;
+			continue;
+		}
+
+#if defined(USE_URING)
+		/* io_uring waits for room itself */
+		continue;
+#elif defined(__linux__)
+		snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+		new_fd = open(path, O_WRONLY | O_NOCTTY | O_NONBLOCK |
+		    (flags & O_APPEND));
+		if (new_fd != -1) {
+			if (dup2(new_fd, fd) == -1)
+				err(1, "dup2");
+			close(new_fd);
+			sinks[i].nonblock = true;
+			continue;
+		}
+#endif
+		if (!S_ISFIFO(st.st_mode) && !S_ISSOCK(st.st_mode))
+			continue;
+		if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+			continue;
+
+		sinks[i].flags = flags;
+		sinks[i].nonblock = true;
+	}
+
+	atexit(restore_sinks);
+}
+
+/* undoes init_sinks() for descriptors we share with others */
+static void
+restore_sinks(void)
+{
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		if (sinks[i].flags != -1)
+			fcntl(sinks[i].fd, F_SETFL, sinks[i].flags);
+		sinks[i].flags = -1;
+	}
+}
+
+/*
+ * Queues a buffer (or splicing piper) and writes what it can. One that
+ * has a line to finish goes first, and is already waiting if queued.
+ */
+static void
+sink_queue(struct sink *sink, struct obuf *buf)
+{
+	if (buf->queued) {
+		if (sink->midline == buf && !sink->watched)
+			sink_flush(sink);
+		return;
+	}
+
+	buf->queued = true;
+	if (sink->midline == buf) {
+		if (!(buf->next = sink->head))
+			sink->tail = &buf->next;
+		sink->head = buf;
+	} else {
+		buf->next = NULL;
+		*sink->tail = buf;
+		sink->tail = &buf->next;
+	}
+
+	if (sink->head == buf)
+		sink_flush(sink);
+}
+
+/*
+ * Writes out queued buffers in order until done or the output is full,
+ * in which case we wait for it to become writable. Blocking outputs are
+ * written in full.
+ */
+static void
+sink_flush(struct sink *sink)
+{
+	struct obuf *buf;
+	struct piper *piper;
+	size_t end;
+	ssize_t nw;
+	int ret;
+
+#if defined(USE_URING)
+	/* the queue is the kernel's until they're done, see sink_wrote() */
+	if (sink->writes)
+		return;
+#endif
+
+	if (progress_shown && sink->tty && sink->head)
+		clear_progress();
+
+	while ((buf = sink->head)) {
+		piper = buf->piper;
+		end = piper ? buf->ready : buf->len;
+
+		/* not into the middle of another's line */
+		if (sink->midline && sink->midline != buf)
+			break;
+
+		if (piper && piper->splicing) {
+			if ((ret = splice_piper(piper)) == SPLICE_BLOCKED)
+				goto wait;
+			piper->splicing = false;
+		} else if (buf->off < end) {
+#if defined(USE_URING)
+			/* done with the poll after an EAGAIN, if any */
+			ev_del(sink->fd, EV_WRITE);
+			sink->watched = true;
+			sink_submit(sink);
+			return;
+#else
+			nw = write(sink->fd, buf->data + buf->off,
+			    end - buf->off);
+			if (nw == -1 && errno == EAGAIN)
+				goto wait;
+			if (nw == -1 && errno != EINTR)
+				err(1, "write");
+			if (nw > 0) {
+				buf->off += (size_t)nw;
+				sink_mark(sink, buf, buf->data[buf->off-1]);
+			}
+			continue;
+#endif
+		} else if (buf->spill_fd != -1) {
+			/* refill from the spill file */
+			if (buf->cap < 65536) {
+				buf->cap = 65536;
+				if (!(buf->data = realloc(buf->data,
+				    buf->cap)))
+					err(1, "realloc");
+			}
+			if ((nw = read(buf->spill_fd, buf->data,
+			    buf->cap)) == -1)
+				err(1, "read");
+			if (!nw) {
+				close(buf->spill_fd);
+				buf->spill_fd = -1;
+			}
+			buf->off = 0;
+			buf->len = (size_t)nw;
+			continue;
+		} else if (sink->midline == buf && piper &&
+		    piper->in_fd != -1) {
+			/* the rest of the line can't wait, it's started */
+			if (buf->off < buf->len) {
+				buf->ready = buf->len;
+				continue;
+			}
+			resume_piper(piper);
+			break;
+		} else if (buf->off < buf->len) {
+			/*
+			 * Only a partial line left. Give the others a turn
+			 * first, in the hope the rest of it comes in.
+			 */
+			if (!buf->rotated && buf->next) {
+				sink->head = buf->next;
+				buf->next = NULL;
+				*sink->tail = buf;
+				sink->tail = &buf->next;
+				buf->rotated = true;
+				resume_piper(piper);
+			} else
+				buf->ready = buf->len;
+			continue;
+		} else
+			ret = SPLICE_EMPTY;
+
+		if (!(sink->head = buf->next))
+			sink->tail = &sink->head;
+		buf->queued = false;
+		if (sink->midline == buf)
+			sink->midline = NULL;	/* nothing more can come */
+
+		if (ret == SPLICE_EOF)
+			piper_eof(piper);
+		else
+			sink_drained(buf);
+	}
+
+	if (sink->watched) {
+		ev_del(sink->fd, EV_WRITE);
+		sink->watched = false;
+	}
+	return;
+
+wait:
+	if (!sink->nonblock)
+		errx(1, "unexpected EAGAIN");
+	if (!sink->watched) {
+		ev_add(sink->fd, EV_WRITE, sink);
+		sink->watched = true;
+	}
+}
+
+/* a buffer has been written out and dequeued */
+static void
+sink_drained(struct obuf *buf)
+{
+	struct piper *piper;
+
+	if ((piper = buf->piper)) {
+		buf->off = buf->len = buf->ready = 0;
+		if (piper->in_fd == -1)
+			free_piper(piper);
+		else
+			resume_piper(piper);
+	} else {
+		free(buf->data);
+		buf->data = NULL;
+		if (!--buf->group->refs)
+			free(buf->group);
+	}
+}
+
+/*
+ * Notes the last byte written to the sink, from the buffer. Unless it
+ * ended a line, the rest of that has to go out before anything else.
+ * Without prefixes lines aren't kept whole anyway.
+ */
+static void
+sink_mark(struct sink *sink, struct obuf *buf, char last)
+{
+	if (!no_prefix)
+		sink->midline = last == '\n' ? NULL : buf;
+}
+
+#if defined(USE_URING)
+/*
+ * Writes the queue from the head on as a chain of linked writes, up to
+ * the first buffer that has more to do once written: a partial line, one
+ * it's written part of, or more to come from its spill file. sink_flush()
+ * takes it from there once they're all done.
+ */
+static void
+sink_submit(struct sink *sink)
+{
+	struct obuf *buf, *next;
+	size_t end, len;
+
+	for (buf = sink->head; buf; buf = next) {
+		end = buf->piper ? buf->ready : buf->len;
+		len = MIN(end - buf->off, (size_t)INT_MAX);
+
+		buf->whole = buf->off + len == buf->len &&
+		    buf->spill_fd == -1;
+		next = NULL;
+		if (buf->whole && (buf->data[buf->len-1] == '\n' ||
+		    no_prefix || !buf->piper || buf->piper->in_fd == -1) &&
+		    buf->next && buf->next->off <
+		    (buf->next->piper ? buf->next->ready : buf->next->len))
+			next = buf->next;
+
+		ev_write(sink->fd, buf->data + buf->off, len, buf,
+		    next != NULL);
+		buf->sink = sink;
+		buf->writing = true;
+		buf->wend = buf->off + len;
+		sink->writes++;
+	}
+}
+
+/*
+ * An ev_write() of the buffer is done, or was cancelled as one before it
+ * came up short. Like write() would, EPIPE raises SIGPIPE.
+ */
+static void
+sink_wrote(struct obuf *buf, int res)
+{
+	struct sink *sink = buf->sink;
+
+	if (res > 0) {
+		buf->off += (size_t)res;
+		sink_mark(sink, buf, buf->data[buf->off-1]);
+	} else if (res == -EAGAIN)
+		sink->again = true;	/* it was non-blocking already */
+	else if (res < 0 && res != -ECANCELED && res != -EINTR) {
+		if (res == -EPIPE)
+			raise(SIGPIPE);
+		errno = -res;
+		err(1, "write");
+	}
+
+	if (!--sink->writes)
+		sink_written(sink);
+}
+
+/*
+ * The whole chain is done. Buffers that were written out in full are
+ * dequeued, as sink_flush() would have right after its write(); any that
+ * got more data in the meantime go to the back of the queue again, as if
+ * queued afresh, so they don't get in before the rest of a short write.
+ */
+static void
+sink_written(struct sink *sink)
+{
+	struct obuf *buf, *requeue = NULL, **rtail = &requeue;
+
+	while ((buf = sink->head) && buf->writing) {
+		if (!buf->whole || buf->off != buf->wend ||
+		    buf == sink->midline)
+			break;
+		buf->writing = false;
+		free(buf->stale);
+		buf->stale = NULL;
+
+		if (!(sink->head = buf->next))
+			sink->tail = &sink->head;
+		buf->next = NULL;
+
+		if (buf->off < buf->len) {
+			buf->rotated = false;
+			*rtail = buf;
+			rtail = &buf->next;
+		} else {
+			buf->queued = false;
+			sink_drained(buf);
+		}
+	}
+
+	/* the rest, from the one that came up short */
+	for (; buf && buf->writing; buf = buf->next) {
+		buf->writing = false;
+		free(buf->stale);
+		buf->stale = NULL;
+	}
+
+	if (requeue) {
+		*sink->tail = requeue;
+		sink->tail = rtail;
+	}
+
+	if (sink->again) {
+		sink->again = false;
+		ev_add(sink->fd, EV_WRITE, sink);
+	} else
+		sink_flush(sink);
+}
+#endif
+
+/* parses a size with an optional K, M or G suffix, in bytes */
+static size_t
+parse_size(const char *s, const char *opt)
+{
+	unsigned long long size;
+	char *end;
+
+	errno = 0;
+	size = strtoull(s, &end, 10);
+	if (errno || end == s)
+		errx(1, "invalid %s: %s", opt, s);
+
+	switch (*end) {
+	case 'g': case 'G': size <<= 10;	/* FALLTHROUGH */
+	case 'm': case 'M': size <<= 10;	/* FALLTHROUGH */
+	case 'k': case 'K': size <<= 10; end++; break;
+	}
+
+	if (*end)
+		errx(1, "invalid %s: %s", opt, s);
+
+	return (size_t)size;
+}
+
+/* parses a duration in seconds, with an optional s, m, h or d suffix */
+static double
+parse_duration(const char *s, const char *opt)
+{
+	double secs;
+	char *end;
+
+	errno = 0;
+	secs = strtod(s, &end);
+	if (errno || end == s || secs < 0)
+		errx(1, "invalid %s: %s", opt, s);
+
+	switch (*end) {
+	case 'd': secs *= 24;	/* FALLTHROUGH */
+	case 'h': secs *= 60;	/* FALLTHROUGH */
+	case 'm': secs *= 60;	/* FALLTHROUGH */
+	case 's': end++; break;
+	}
+
+	if (*end)
+		errx(1, "invalid %s: %s", opt, s);
+
+	return secs;
+}
+
+/*
+ * writev() until done or the descriptor would block, returning true if
+ * everything was written. Advances *iov and *niov past what was and, if
+ * last isn't NULL, points *last at the last byte written, if any.
+ */
+static bool
+write_some(int fd, struct iovec **iov, int *niov, const char **last)
+{
+	char *end = NULL;
+	ssize_t nw;
+
+	while (*niov) {
+		if ((nw = writev(fd, *iov, *niov)) == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+			err(1, "write");
+		}
+
+		while (*niov && (size_t)nw >= (*iov)->iov_len) {
+			if ((*iov)->iov_len)
+				end = (char *)(*iov)->iov_base +
+				    (*iov)->iov_len;
+			nw -= (ssize_t)(*iov)->iov_len;
+			(*iov)++;
+			(*niov)--;
+		}
+
+		if (*niov && nw) {
+			(*iov)->iov_base = (char *)(*iov)->iov_base + nw;
+			(*iov)->iov_len -= (size_t)nw;
+			end = (*iov)->iov_base;
+		}
+	}
+
+	if (last && end)
+		*last = end - 1;
+
+	return !*niov;
+}
+
+/*
+ * writev() that deals with short writes and, should the descriptor be
+ * non-blocking, with EAGAIN. Modifies iov.
+ */
 static void
-remove_piper(struct piper *piper)
+write_all(int fd, struct iovec *iov, int niov)
 {
-	struct piper **pp;
+	struct pollfd pfd;
 
-	if (close(piper->in_fd) == -1 && errno != EBADF)
-		err(1, "close");
+	while (!write_some(fd, &iov, &niov, NULL)) {
+		pfd.fd = fd;
+		pfd.events = POLLOUT;
+		if (poll(&pfd, 1, -1) == -1 && errno != EINTR)
+			err(1, "poll");
+	}
+}
 
-	for (pp = &pipers; *pp; pp = &(*pp)->next) {
-		if (*pp == piper) {
-			*pp = piper->next;
-			free(piper);
-			break;
-		}
+/*
+ * Every job takes two descriptors, so a high -j easily exceeds the default
+ * soft limit. Raise it as far as we're allowed.
+ */
+static void
+raise_fd_limit(void)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == -1)
+		return;
+#if defined(__APPLE__)
+	/* setrlimit() rejects anything above OPEN_MAX on macOS */
+	if (rl.rlim_max > OPEN_MAX)
+		rl.rlim_max = OPEN_MAX;
+#endif
+	if (rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
 	}
 }
 
+#if !defined(USE_KQUEUE)
+/*
+ * Child exits are made into regular events by having the SIGCHLD handler
+ * write to a pipe that's registered with the backend. Unlike relying on
+ * EINTR this can't lose signals that arrive outside of the wait call.
+ * Without chld, the pipe is only for sig_info() wakeups.
+ */
+static void
+init_sigpipe(bool chld)
+{
+	struct sigaction sa;
+	int flags;
+
+	make_pipe(ev_sigpipe);
+
+	if ((flags = fcntl(ev_sigpipe[0], F_GETFL)) == -1 ||
+	    fcntl(ev_sigpipe[0], F_SETFL, flags | O_NONBLOCK) == -1 ||
+	    (flags = fcntl(ev_sigpipe[1], F_GETFL)) == -1 ||
+	    fcntl(ev_sigpipe[1], F_SETFL, flags | O_NONBLOCK) == -1)
+		err(1, "fcntl");
+
+	if (!chld)
+		return;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sig_chld;
+	sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+	sigemptyset(&sa.sa_mask);
+
+	if (sigaction(SIGCHLD, &sa, NULL) == -1)
+		err(1, "sigaction");
+}
+
 static void
 sig_chld(int sig)
 {
+	int saved_errno = errno;
+	ssize_t nw;
+
 	(void)sig;
 
-	/* nothing, we just want select() interrupted */
+	/* if the pipe is full there's already a wakeup pending */
+	nw = write(ev_sigpipe[1], "", 1);
+	(void)nw;
+	errno = saved_errno;
+}
+
+static void
+drain_sigpipe(void)
+{
+	char buf[64];
+
+	while (read(ev_sigpipe[0], buf, sizeof(buf)) > 0)
+		;
+}
+
+#if !defined(USE_URING)
+/* no per-child registration needed, SIGCHLD covers all */
+static void
+ev_add_child(pid_t pid)
+{
+	(void)pid;
+}
+#endif
+#endif
+
+#if defined(USE_EPOLL)
+
+static void
+ev_init(void)
+{
+	if ((ev_fd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+		err(1, "epoll_create1");
+
+	init_sigpipe(true);
+	ev_add(ev_sigpipe[0], EV_READ, ev_sigpipe);
+}
+
+/*
+ * Registers the descriptor for reading or writing, not both. ev_wait()
+ * returns udata with events for it.
+ */
+static void
+ev_add(int fd, enum ev_type type, void *udata)
+{
+	struct epoll_event ev;
+	int i;
+
+	if (fd >= ev_regs_cap) {
+		i = ev_regs_cap;
+		ev_regs_cap = MAX(fd+1, ev_regs_cap*2);
+		ev_regs = realloc(ev_regs, ev_regs_cap * sizeof(*ev_regs));
+		if (!ev_regs)
+			err(1, "realloc");
+		memset(ev_regs + i, 0, (ev_regs_cap-i) * sizeof(*ev_regs));
+	}
+
+	ev_regs[fd].type = type;
+	ev_regs[fd].udata = udata;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = type == EV_WRITE ? EPOLLOUT : EPOLLIN;
+	ev.data.fd = fd;
+
+	if (epoll_ctl(ev_fd, EPOLL_CTL_ADD, fd, &ev) == -1)
+		err(1, "epoll_ctl");
+}
+
+static void
+ev_del(int fd, enum ev_type type)
+{
+	struct epoll_event ev;	/* non-NULL for pre-2.6.9 kernels */
+
+	(void)type;
+
+	if (epoll_ctl(ev_fd, EPOLL_CTL_DEL, fd, &ev) == -1)
+		err(1, "epoll_ctl");
+}
+
+/*
+ * Waits for events and stores up to max of them in evs, returning their
+ * number. Returns 0 if interrupted by a signal or after timeout ms, unless
+ * that's -1.
+ */
+static int
+ev_wait(struct event *evs, int max, int timeout)
+{
+	struct epoll_event eevs[64];
+	int n, i;
+
+	n = epoll_wait(ev_fd, eevs, MIN(max, (int)LEN(eevs)), timeout);
+	if (n == -1) {
+		if (errno != EINTR)
+			err(1, "epoll_wait");
+		return 0;
+	}
+
+	for (i = 0; i < n; i++) {
+		evs[i] = ev_regs[eevs[i].data.fd];
+		if (evs[i].udata == ev_sigpipe) {
+			drain_sigpipe();
+			evs[i].type = EV_CHILD;
+			evs[i].udata = NULL;
+		}
+	}
+
+	return n;
+}
+
+#elif defined(USE_KQUEUE)
+
+static void
+ev_init(void)
+{
+	if ((ev_fd = kqueue()) == -1)
+		err(1, "kqueue");
+}
+
+static void
+ev_add(int fd, enum ev_type type, void *udata)
+{
+	struct kevent kev;
+
+	EV_SET(&kev, fd, type == EV_WRITE ? EVFILT_WRITE : EVFILT_READ,
+	    EV_ADD, 0, 0, udata);
+	if (kevent(ev_fd, &kev, 1, NULL, 0, NULL) == -1)
+		err(1, "kevent");
+}
+
+static void
+ev_del(int fd, enum ev_type type)
+{
+	struct kevent kev;
+
+	EV_SET(&kev, fd, type == EV_WRITE ? EVFILT_WRITE : EVFILT_READ,
+	    EV_DELETE, 0, 0, NULL);
+	if (kevent(ev_fd, &kev, 1, NULL, 0, NULL) == -1)
+		err(1, "kevent");
+}
+
+/* EVFILT_PROC gives us exits directly, no SIGCHLD handler needed */
+static void
+ev_add_child(pid_t pid)
+{
+	struct kevent kev;
+
+	EV_SET(&kev, pid, EVFILT_PROC, EV_ADD | EV_ONESHOT, NOTE_EXIT, 0,
+	    NULL);
+	if (kevent(ev_fd, &kev, 1, NULL, 0, NULL) == -1) {
+		if (errno != ESRCH)
+			err(1, "kevent");
+		/* already gone, report on the next ev_wait() */
+		ev_child_pending = true;
+	}
+}
+
+static int
+ev_wait(struct event *evs, int max, int timeout)
+{
+	struct kevent kevs[64];
+	struct timespec ts;
+	int n, i;
+
+	if (ev_child_pending)
+		timeout = 0;
+	ts.tv_sec = timeout / 1000;
+	ts.tv_nsec = timeout % 1000 * 1000000L;
+
+	n = kevent(ev_fd, NULL, 0, kevs, MIN(max-1, (int)LEN(kevs)),
+	    timeout == -1 ? NULL : &ts);
+	if (n == -1) {
+		if (errno != EINTR)
+			err(1, "kevent");
+		return 0;
+	}
+
+	for (i = 0; i < n; i++) {
+		switch (kevs[i].filter) {
+		case EVFILT_PROC:  evs[i].type = EV_CHILD; break;
+		case EVFILT_WRITE: evs[i].type = EV_WRITE; break;
+		default:           evs[i].type = EV_READ; break;
+		}
+		evs[i].udata = kevs[i].udata;
+	}
+
+	if (ev_child_pending) {
+		ev_child_pending = false;
+		evs[n].type = EV_CHILD;
+		evs[n++].udata = NULL;
+	}
+
+	return n;
+}
+
+#elif defined(USE_URING)
+
+/*
+ * Submits what's queued and, with GETEVENTS, runs deferred completions and
+ * waits for at least min_complete of them, or timeout ms unless that's -1.
+ * Returns -1 with errno as io_uring_enter().
+ */
+static int
+ev_enter(unsigned min_complete, int timeout)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned to_submit;
+
+	__atomic_store_n(ev_sq_tail, ev_sq_local, __ATOMIC_RELEASE);
+	to_submit = ev_sq_local - __atomic_load_n(ev_sq_head, __ATOMIC_ACQUIRE);
+
+	memset(&arg, 0, sizeof(arg));
+	if (timeout >= 0) {
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = timeout % 1000 * 1000000L;
+		arg.ts = (uintptr_t)&ts;
+	}
+
+	return (int)syscall(SYS_io_uring_enter, ev_fd, to_submit,
+	    min_complete, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+	    &arg, sizeof(arg));
+}
+
+/* the next free submission queue entry, cleared */
+static struct io_uring_sqe *
+ev_sqe(void)
+{
+	struct io_uring_sqe *sqe;
+
+	/* full, hand these to the kernel first */
+	if (ev_sq_local - __atomic_load_n(ev_sq_head, __ATOMIC_ACQUIRE) ==
+	    ev_sq_entries && ev_enter(0, 0) == -1 && errno != EINTR &&
+	    errno != EBUSY)
+		err(1, "io_uring_enter");
+
+	sqe = &ev_sqes[ev_sq_local++ & *ev_sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+/* a one-shot poll, as multishot ones are edge triggered */
+static void
+ev_poll(int fd)
+{
+	struct io_uring_sqe *sqe;
+	struct ev_reg *reg = &ev_regs[fd];
+	uint32_t events;
+
+	events = reg->ev.type == EV_WRITE ? POLLOUT : POLLIN;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	events = events << 16 | events >> 16;
+#endif
+
+	sqe = ev_sqe();
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = events;
+	sqe->user_data = (uint64_t)reg->gen << 32 | (uint32_t)fd << 2 |
+	    EV_KIND_POLL;
+	reg->armed = true;
+}
+
+static void
+ev_init(void)
+{
+	struct io_uring_params params;
+	struct io_uring_probe *probe;
+	struct io_uring_buf_reg reg;
+	size_t sq_len, cq_len, probe_len;
+	char *sq, *cq;
+	unsigned i, num_bufs;
+
+	/* with deferred task work, completions are handled when we ask */
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+	if ((ev_fd = (int)syscall(SYS_io_uring_setup, EV_ENTRIES,
+	    &params)) == -1) {
+		memset(&params, 0, sizeof(params));
+		if ((ev_fd = (int)syscall(SYS_io_uring_setup, EV_ENTRIES,
+		    &params)) == -1)
+			err(1, "io_uring_setup");
+	}
+	if (!(params.features & IORING_FEAT_EXT_ARG))
+		errx(1, "io_uring too old for USE_URING (Linux 5.11)");
+
+	sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cq_len = params.cq_off.cqes +
+	    params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		sq_len = cq_len = MAX(sq_len, cq_len);
+
+	sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, ev_fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		err(1, "mmap");
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		cq = sq;
+	else if ((cq = mmap(NULL, cq_len, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, ev_fd, IORING_OFF_CQ_RING)) ==
+	    MAP_FAILED)
+		err(1, "mmap");
+	ev_sqes = mmap(NULL, params.sq_entries * sizeof(*ev_sqes),
+	    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ev_fd,
+	    IORING_OFF_SQES);
+	if (ev_sqes == MAP_FAILED)
+		err(1, "mmap");
+
+	ev_sq_head = (unsigned *)(sq + params.sq_off.head);
+	ev_sq_tail = (unsigned *)(sq + params.sq_off.tail);
+	ev_sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+	ev_cq_head = (unsigned *)(cq + params.cq_off.head);
+	ev_cq_tail = (unsigned *)(cq + params.cq_off.tail);
+	ev_cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+	ev_cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+	ev_sq_entries = params.sq_entries;
+	ev_sq_local = *ev_sq_tail;
+
+	/* entries are used in order, so the indirection is the identity */
+	for (i = 0; i < params.sq_entries; i++)
+		((unsigned *)(sq + params.sq_off.array))[i] = i;
+
+	probe_len = sizeof(*probe) + 256 * sizeof(probe->ops[0]);
+	if (!(probe = calloc(1, probe_len)))
+		err(1, "calloc");
+	if (!syscall(SYS_io_uring_register, ev_fd, IORING_REGISTER_PROBE,
+	    probe, 256) && probe->last_op >= EV_OP_WAITID &&
+	    (probe->ops[EV_OP_WAITID].flags & IO_URING_OP_SUPPORTED))
+		ev_waitid = true;
+	free(probe);
+
+	/*
+	 * A buffer for every piper's read, so none goes without: they're
+	 * given back as soon as they're handled. --hosts only lowers -j.
+	 */
+	for (num_bufs = 64; num_bufs < 2 * (unsigned)max_jobs &&
+	    num_bufs < 32768; num_bufs *= 2)
+		;
+	ev_bufring = mmap(NULL, num_bufs * sizeof(struct io_uring_buf),
+	    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ev_bufring == MAP_FAILED)
+		err(1, "mmap");
+	if (!(ev_bufs = malloc((size_t)num_bufs * EV_BUF_SIZE)))
+		err(1, "malloc");
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uintptr_t)ev_bufring;
+	reg.ring_entries = num_bufs;
+	reg.bgid = 0;
+	if (syscall(SYS_io_uring_register, ev_fd, IORING_REGISTER_PBUF_RING,
+	    &reg, 1) == -1) {
+		if (errno == EINVAL)
+			errx(1, "io_uring too old for USE_URING (Linux 5.19)");
+		err(1, "IORING_REGISTER_PBUF_RING");
+	}
+
+	ev_bufs_mask = num_bufs - 1;
+	for (i = 0; i < num_bufs; i++)
+		ev_give((int)i);
+
+	init_sigpipe(!ev_waitid);
+	ev_add(ev_sigpipe[0], EV_READ, ev_sigpipe);
+}
+
+/*
+ * Like epoll, one registration per descriptor. Nothing is submitted until
+ * the next ev_wait(), so a descriptor may be added, removed and closed in
+ * between, and its number reused. Those polls are told apart by gen.
+ */
+static void
+ev_add(int fd, enum ev_type type, void *udata)
+{
+	int i;
+
+	if (fd >= ev_regs_cap) {
+		i = ev_regs_cap;
+		ev_regs_cap = MAX(fd+1, ev_regs_cap*2);
+		ev_regs = realloc(ev_regs, ev_regs_cap * sizeof(*ev_regs));
+		if (!ev_regs)
+			err(1, "realloc");
+		memset(ev_regs + i, 0, (ev_regs_cap-i) * sizeof(*ev_regs));
+	}
+
+	ev_regs[fd].ev.type = type;
+	ev_regs[fd].ev.udata = udata;
+	ev_regs[fd].gen++;
+	ev_regs[fd].added = true;
+	ev_poll(fd);
+}
+
+static void
+ev_del(int fd, enum ev_type type)
+{
+	struct io_uring_sqe *sqe;
+	struct ev_reg *reg;
+
+	(void)type;
+
+	if (fd >= ev_regs_cap || !(reg = &ev_regs[fd])->added)
+		return;
+
+	if (reg->armed) {
+		sqe = ev_sqe();
+		sqe->opcode = IORING_OP_POLL_REMOVE;
+		sqe->fd = -1;
+		sqe->addr = (uint64_t)reg->gen << 32 | (uint32_t)fd << 2 |
+		    EV_KIND_POLL;
+		sqe->user_data = EV_TAG_REMOVE;
+	}
+
+	reg->added = false;
+	reg->armed = false;
+}
+
+/*
+ * Waits with WNOWAIT, like EVFILT_PROC, leaving the reaping and its rusage
+ * to wait4(). ECHILD means that's already happened.
+ */
+static void
+ev_add_child(pid_t pid)
+{
+	struct io_uring_sqe *sqe;
+
+	if (!ev_waitid)
+		return;
+
+	sqe = ev_sqe();
+	sqe->opcode = EV_OP_WAITID;
+	sqe->fd = pid;
+	sqe->len = P_PID;
+	sqe->file_index = WEXITED | WNOWAIT;
+	sqe->addr2 = (uintptr_t)&ev_siginfo;
+	sqe->user_data = EV_TAG_CHILD;
+}
+
+/*
+ * Reads from fd into a buffer the kernel picks from the ring when there's
+ * data, for an EV_DATA event. The buffer is the caller's until ev_give().
+ */
+static void
+ev_read(int fd, void *udata)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = ev_sqe();
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->off = (uint64_t)-1;	/* no position, it's a pipe */
+	sqe->len = EV_BUF_SIZE;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = 0;
+	sqe->user_data = (uintptr_t)udata | EV_KIND_READ;
+}
+
+/*
+ * Writes data, which has to stay put until the EV_WROTE event. With link,
+ * the next ev_write() only starts once this one is done, and is cancelled
+ * if it came up short or failed.
+ */
+static void
+ev_write(int fd, const char *data, size_t len, void *udata, bool link)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = ev_sqe();
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = fd;
+	sqe->off = (uint64_t)-1;
+	sqe->addr = (uintptr_t)data;
+	sqe->len = (unsigned)len;
+	sqe->flags = link ? IOSQE_IO_LINK : 0;
+	sqe->user_data = (uintptr_t)udata | EV_KIND_WRITE;
+}
+
+/* hands an EV_DATA buffer back to the ring */
+static void
+ev_give(int bid)
+{
+	struct io_uring_buf *buf;
+	uint16_t tail;
+
+	tail = ev_bufring->tail;
+	buf = &ev_bufring->bufs[tail & ev_bufs_mask];
+	buf->addr = (uintptr_t)(ev_bufs + (size_t)bid * EV_BUF_SIZE);
+	buf->len = EV_BUF_SIZE;
+	buf->bid = (uint16_t)bid;
+	__atomic_store_n(&ev_bufring->tail, (uint16_t)(tail+1),
+	    __ATOMIC_RELEASE);
+}
+
+/*
+ * Polls that fired are submitted again with the next call, after the
+ * event was handled, for the level-triggered behaviour of the others.
+ */
+static int
+ev_wait(struct event *evs, int max, int timeout)
+{
+	struct io_uring_cqe *cqe;
+	struct ev_reg *reg;
+	unsigned head, tail;
+	uint64_t data;
+	int n = 0, fd;
+
+	head = *ev_cq_head;
+	tail = __atomic_load_n(ev_cq_tail, __ATOMIC_ACQUIRE);
+
+	if (ev_enter(head == tail && timeout ? 1 : 0, timeout) == -1 &&
+	    errno != EINTR && errno != ETIME && errno != EBUSY)
+		err(1, "io_uring_enter");
+
+	tail = __atomic_load_n(ev_cq_tail, __ATOMIC_ACQUIRE);
+
+	for (; head != tail && n < max; head++) {
+		cqe = &ev_cqes[head & *ev_cq_mask];
+		data = cqe->user_data;
+
+		if (data == EV_TAG_CHILD) {
+			if (cqe->res != -ECHILD) {
+				evs[n].type = EV_CHILD;
+				evs[n++].udata = NULL;
+			}
+			continue;
+		}
+		if (data == EV_TAG_REMOVE)
+			continue;
+
+		if ((data & 3) == EV_KIND_READ || (data & 3) == EV_KIND_WRITE) {
+			evs[n].type = (data & 3) == EV_KIND_READ ?
+			    EV_DATA : EV_WROTE;
+			evs[n].udata = (void *)(uintptr_t)(data & ~3ULL);
+			evs[n].res = cqe->res;
+			evs[n].bid = -1;
+			evs[n].data = NULL;
+			if (cqe->flags & IORING_CQE_F_BUFFER) {
+				evs[n].bid = (int)(cqe->flags >>
+				    IORING_CQE_BUFFER_SHIFT);
+				evs[n].data = ev_bufs +
+				    (size_t)evs[n].bid * EV_BUF_SIZE;
+			}
+			n++;
+			continue;
+		}
+
+		/* left over from an earlier registration */
+		fd = (int)((uint32_t)data >> 2);
+		if (fd >= ev_regs_cap || !(reg = &ev_regs[fd])->added ||
+		    reg->gen != (uint32_t)(data >> 32))
+			continue;
+
+		evs[n] = reg->ev;
+		if (evs[n].udata == ev_sigpipe) {
+			drain_sigpipe();
+			evs[n].type = EV_CHILD;
+			evs[n].udata = NULL;
+		}
+		n++;
+		ev_poll(fd);
+	}
+
+	__atomic_store_n(ev_cq_head, head, __ATOMIC_RELEASE);
+	return n;
 }
+
+#else /* USE_POLL */
+
+static void
+ev_init(void)
+{
+	init_sigpipe(true);
+	ev_add(ev_sigpipe[0], EV_READ, ev_sigpipe);
+}
+
+/* one registration per descriptor, like epoll */
+static void
+ev_add(int fd, enum ev_type type, void *udata)
+{
+	int i;
+
+	if (ev_count == ev_cap) {
+		ev_cap = ev_cap ? ev_cap*2 : 64;
+		ev_pollfds = realloc(ev_pollfds, ev_cap * sizeof(*ev_pollfds));
+		ev_regs = realloc(ev_regs, ev_cap * sizeof(*ev_regs));
+		if (!ev_pollfds || !ev_regs)
+			err(1, "realloc");
+	}
+
+	if (fd >= ev_index_cap) {
+		i = ev_index_cap;
+		ev_index_cap = MAX(fd+1, ev_index_cap*2);
+		ev_index = realloc(ev_index, ev_index_cap * sizeof(*ev_index));
+		if (!ev_index)
+			err(1, "realloc");
+		for (; i < ev_index_cap; i++)
+			ev_index[i] = -1;
+	}
+
+	ev_pollfds[ev_count].fd = fd;
+	ev_pollfds[ev_count].events = type == EV_WRITE ? POLLOUT : POLLIN;
+	ev_pollfds[ev_count].revents = 0;
+	ev_regs[ev_count].type = type;
+	ev_regs[ev_count].udata = udata;
+	ev_index[fd] = ev_count++;
+}
+
+static void
+ev_del(int fd, enum ev_type type)
+{
+	int i;
+
+	(void)type;
+
+	if (fd >= ev_index_cap || (i = ev_index[fd]) == -1)
+		return;
+
+	/* move the last entry into the hole */
+	ev_count--;
+	ev_pollfds[i] = ev_pollfds[ev_count];
+	ev_regs[i] = ev_regs[ev_count];
+	ev_index[ev_pollfds[i].fd] = i;
+	ev_index[fd] = -1;
+}
+
+static int
+ev_wait(struct event *evs, int max, int timeout)
+{
+	int n, i;
+
+	if (poll(ev_pollfds, (nfds_t)ev_count, timeout) == -1) {
+		if (errno != EINTR)
+			err(1, "poll");
+		return 0;
+	}
+
+	/* POLLHUP is reported on EOF, which run_piper() needs to see */
+	for (i = 0, n = 0; i < ev_count && n < max; i++) {
+		if (!ev_pollfds[i].revents)
+			continue;
+		if (ev_regs[i].udata == ev_sigpipe) {
+			drain_sigpipe();
+			evs[n].type = EV_CHILD;
+			evs[n++].udata = NULL;
+		} else
+			evs[n++] = ev_regs[i];
+	}
+
+	return n;
+}
+
+#endif